@@ -7,6 +7,11 @@ import json
 import os
 import sys
 
+try:
+    import blake3
+except ImportError:
+    blake3 = None
+
 def main():
     if len(sys.argv) < 3:
         print('Usage: make_links.py abs_path_to_dropbox rel_path_to_dir_to_process [old.json]')
@@ -42,6 +47,8 @@ def main():
                 if 'lwt' in old_json[file].keys() and old_json[file]['lwt'] == lwt:
                     url = old_json[file]['url']
                     obj['md5'] = old_json[file]['md5']
+                    if 'hash' in old_json[file].keys():
+                        obj['hash'] = old_json[file]['hash']
                 else:
                     file_md5 = md5(real_filename)
                     url = old_json[file]['url']
@@ -55,12 +62,17 @@ def main():
                 url = url[:len(url)-1] + '1'
                 print('new: ' + url)
 
+            # fast hash for new clients, md5 stays for older ones
+            if blake3 and 'hash' not in obj.keys():
+                obj['hash'] = 'blake3:' + file_hash(real_filename, blake3.blake3())
+
             # add to json
             obj['name'] = os.path.basename(filename)
             obj['url'] = url
             obj['check_path'] = file
             obj['packed'] = False
             obj['lwt'] = lwt
+            obj['size'] = os.path.getsize(real_filename)
 
             data.append(obj)
     json_data = dict()
@@ -68,14 +80,16 @@ def main():
     json.dump(json_data, open(base_name + '.json', 'w'), indent = 2, sort_keys = True)
 
 def md5(file):
-    md5 = hashlib.md5()
+    return file_hash(file, hashlib.md5())
+
+def file_hash(file, h):
     f = open(file, mode = 'rb')
     while True:
         data = f.read(2 ** 20)
         if not data:
             break
-        md5.update(data)
-    return md5.hexdigest()
+        h.update(data)
+    return h.hexdigest()
 
 if __name__ == '__main__':
     main()
\ No newline at end of file
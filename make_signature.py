@@ -0,0 +1,48 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+
+import hashlib
+import json
+import os
+import sys
+
+def main():
+    if len(sys.argv) < 2:
+        print('Usage: make_signature.py file [block_size]')
+        return
+    file = sys.argv[1]
+    size = os.path.getsize(file)
+    if len(sys.argv) > 2:
+        block_size = int(sys.argv[2])
+    else:
+        # keep signatures small for huge files
+        block_size = 64 * 1024
+        while size // block_size > 16384:
+            block_size *= 2
+
+    blocks = []
+    f = open(file, mode = 'rb')
+    while True:
+        data = f.read(block_size)
+        if not data:
+            break
+        blocks.append({'weak': weak(data), 'md5': hashlib.md5(data).hexdigest()})
+
+    json_data = dict()
+    json_data['block_size'] = block_size
+    json_data['size'] = size
+    json_data['blocks'] = blocks
+    json.dump(json_data, open(file + '.sig.json', 'w'))
+
+# rsync rolling checksum
+def weak(data):
+    a = 0
+    b = 0
+    n = len(data)
+    for i, x in enumerate(data):
+        a += x
+        b += (n - i) * x
+    return (a & 0xffff) | ((b & 0xffff) << 16)
+
+if __name__ == '__main__':
+    main()
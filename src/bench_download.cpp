@@ -0,0 +1,891 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Download benchmark.
+//
+// Starts a local HTTP stand-in for the file hosting, generates synthetic
+// manifests and runs download_files() end to end against them:
+//  cold  - nothing is on disk yet
+//  warm  - everything is up to date
+//  stale - part of files has a new version on the server
+//  delta - a few bytes change in part of files, the manifest gives block
+//          signatures for them; only the changed blocks may be requested
+//  resume - into an empty tree, the first response for every file larger
+//           than drop bytes is cut; downloads must go on with a Range
+//           request from the .part instead of starting over
+//  repair - a few files lose their digest in the manifest, some files are
+//           removed or damaged; --repair must bring all of them back
+//
+// Options are key=value pairs (bootstrapper options go before them):
+//  files=1000 distribution=lognormal|uniform|fixed min=1024 max=67108864
+//  median=262144 packed=0.1 stale=0.1 drop=65536
+//  scenario=all|cold|warm|stale|delta|resume|repair seed=1
+//
+// Example:
+//  bench_download --bootstrap-json Bootstrap.json -j 16 files=5000 packed=0
+
+#include "digest.h"
+#include "download.h"
+#include "functional.h"
+#include "trace.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "bench");
+
+namespace ip = boost::asio::ip;
+
+int version()
+{
+    return BOOTSTRAPPER_VERSION;
+}
+
+void print_version()
+{
+    LOG_INFO(logger, "Polygon-4 Download Benchmark Version " << version());
+}
+
+//
+// types
+//
+
+struct bench_options
+{
+    int files = 1000;
+    String distribution = "lognormal";
+    int64_t min_size = 1024;
+    int64_t max_size = 64 << 20;
+    int64_t median_size = 256 << 10;
+    // fraction of entries that are archives
+    double packed = 0.1;
+    // fraction of entries changed for the stale and delta runs
+    double stale = 0.1;
+    // bytes sent before a connection is cut in the resume run
+    int64_t drop = 64 << 10;
+    String scenario = "all";
+    uint32_t seed = 1;
+
+    void parse(int argc, char *argv[])
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            String arg = argv[i];
+            auto p = arg.find('=');
+            if (arg[0] == '-' || p == arg.npos)
+            {
+                // value of a bootstrapper option
+                continue;
+            }
+            auto k = arg.substr(0, p);
+            auto v = arg.substr(p + 1);
+            if (k == "files")
+                files = std::stoi(v);
+            else if (k == "distribution")
+                distribution = v;
+            else if (k == "min")
+                min_size = std::stoll(v);
+            else if (k == "max")
+                max_size = std::stoll(v);
+            else if (k == "median")
+                median_size = std::stoll(v);
+            else if (k == "packed")
+                packed = std::stod(v);
+            else if (k == "stale")
+                stale = std::stod(v);
+            else if (k == "drop")
+                drop = std::stoll(v);
+            else if (k == "scenario")
+                scenario = v;
+            else if (k == "seed")
+                seed = std::stoul(v);
+            else
+                throw SW_RUNTIME_ERROR("Unknown benchmark option: " + k);
+        }
+        if (distribution != "lognormal" && distribution != "uniform" && distribution != "fixed")
+            throw SW_RUNTIME_ERROR("Unknown size distribution: " + distribution);
+        if (drop <= 0)
+            throw SW_RUNTIME_ERROR("drop must be positive");
+    }
+};
+
+// Contents of a synthetic file is a window into one random pattern,
+// so nothing has to be stored per file. Archives are small and kept.
+struct synthetic_file
+{
+    int64_t size = 0;
+    bool packed = false;
+    int version = 0;
+    String hash;
+    String archive;
+    // bytes written over the pattern at patch_offset in the delta run
+    int64_t patch_offset = 0;
+    String patch;
+    // block signature json of the current contents, when patched
+    String signature;
+    // the manifest gives no digest for it
+    bool unhashed = false;
+};
+
+class synthetic_tree
+{
+public:
+    static constexpr size_t pattern_size = 1 << 20;
+    // total size of files inside one archive
+    static constexpr int64_t max_archive_payload = 4 << 20;
+    static constexpr int64_t signature_block_size = 64 << 10;
+
+    std::vector<synthetic_file> files;
+
+    void generate(const bench_options &o)
+    {
+        std::mt19937_64 rng(o.seed);
+        // doubled, so any window of pattern_size bytes is contiguous
+        pattern.resize(pattern_size);
+        for (auto &c : pattern)
+            c = (char)rng();
+        pattern += pattern;
+
+        std::lognormal_distribution<double> lognormal(std::log((double)o.median_size), 1.5);
+        std::uniform_int_distribution<int64_t> uniform(o.min_size, o.max_size);
+        std::bernoulli_distribution packed(o.packed);
+        files.resize(o.files);
+        for (auto &f : files)
+        {
+            if (o.distribution == "lognormal")
+                f.size = (int64_t)lognormal(rng);
+            else if (o.distribution == "uniform")
+                f.size = uniform(rng);
+            else
+                f.size = o.median_size;
+            f.size = std::clamp(f.size, o.min_size, o.max_size);
+            f.packed = packed(rng);
+            if (f.packed)
+                f.size = std::min(f.size, max_archive_payload);
+        }
+        for (size_t i = 0; i < files.size(); i++)
+            update(i);
+    }
+
+    // new version of every entry with the given probability
+    void make_stale(const bench_options &o)
+    {
+        std::mt19937_64 rng(o.seed + 1);
+        std::bernoulli_distribution stale(o.stale);
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (!stale(rng))
+                continue;
+            files[i].version++;
+            update(i);
+        }
+    }
+
+    // Changes a few bytes in every file with the given probability and
+    // makes signatures for them. Returns indices of changed files.
+    std::vector<size_t> make_delta(const bench_options &o)
+    {
+        std::mt19937_64 rng(o.seed + 2);
+        std::bernoulli_distribution changed(o.stale);
+        std::vector<size_t> r;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            auto &f = files[i];
+            // small files are downloaded whole anyway
+            if (f.packed || f.size < 4 * signature_block_size || !changed(rng))
+                continue;
+            f.patch.resize(64);
+            for (auto &c : f.patch)
+                c = (char)rng();
+            f.patch_offset = std::uniform_int_distribution<int64_t>(0, f.size - f.patch.size())(rng);
+            update(i);
+            f.signature = make_signature(i);
+            r.push_back(i);
+        }
+        return r;
+    }
+
+    void read(size_t i, int64_t pos, char *out, size_t n) const
+    {
+        auto &f = files[i];
+        if (f.packed)
+        {
+            memcpy(out, f.archive.data() + pos, n);
+            return;
+        }
+        auto offset = (size_t)((i * 2654435761u + f.version * 40503u + pos) % pattern_size);
+        for (size_t done = 0; done < n;)
+        {
+            auto k = std::min(n - done, pattern_size);
+            memcpy(out + done, pattern.data() + offset, k);
+            done += k;
+        }
+        auto b = std::max(pos, f.patch_offset);
+        auto e = std::min<int64_t>(pos + n, f.patch_offset + f.patch.size());
+        if (b < e)
+            memcpy(out + (b - pos), f.patch.data() + (b - f.patch_offset), e - b);
+    }
+
+    int64_t served_size(size_t i) const
+    {
+        return files[i].packed ? (int64_t)files[i].archive.size() : files[i].size;
+    }
+
+    static String check_path(size_t i)
+    {
+        return "files/" + std::to_string(i % 64) + "/file" + std::to_string(i) + ".bin";
+    }
+
+    String manifest(const String &base_url) const
+    {
+        String s = "{\"files\":[";
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            auto &f = files[i];
+            auto n = std::to_string(i);
+            if (i)
+                s += ",";
+            s += "{\"url\":\"" + base_url + "/f/" + n + "\"";
+            if (f.packed)
+                s += ",\"name\":\"archive" + n + ".tar\",\"check_path\":\"/packed/" + n + "/a.bin\",\"packed\":true";
+            else
+                s += ",\"name\":\"file" + n + ".bin\",\"check_path\":\"/" + check_path(i) + "\"";
+            if (!f.signature.empty())
+                s += ",\"signature\":\"" + base_url + "/s/" + n + "\"";
+            if (!f.unhashed)
+                s += ",\"md5\":\"" + f.hash + "\"";
+            s += ",\"size\":" + std::to_string(served_size(i)) + "}";
+        }
+        s += "]}";
+        return s;
+    }
+
+private:
+    String pattern;
+
+    void update(size_t i)
+    {
+        auto &f = files[i];
+        hash_stream h;
+        if (f.packed)
+        {
+            f.archive = make_archive(i);
+            h.update(f.archive.data(), f.archive.size());
+        }
+        else
+        {
+            std::vector<char> buf(1 << 20);
+            for (int64_t pos = 0; pos < f.size; pos += buf.size())
+            {
+                auto n = (size_t)std::min<int64_t>(buf.size(), f.size - pos);
+                read(i, pos, buf.data(), n);
+                h.update(buf.data(), n);
+            }
+        }
+        f.hash = h.digest();
+    }
+
+    // same as make_signature.py
+    String make_signature(size_t i) const
+    {
+        auto &f = files[i];
+        String s = "{\"block_size\":" + std::to_string(signature_block_size) + ",\"size\":" + std::to_string(f.size) + ",\"blocks\":[";
+        std::vector<char> buf(signature_block_size);
+        for (int64_t pos = 0; pos < f.size; pos += signature_block_size)
+        {
+            auto n = (size_t)std::min<int64_t>(signature_block_size, f.size - pos);
+            read(i, pos, buf.data(), n);
+            // rsync weak checksum
+            uint32_t a = 0, b = 0;
+            for (size_t k = 0; k < n; k++)
+            {
+                a += (uint8_t)buf[k];
+                b += (uint32_t)(n - k) * (uint8_t)buf[k];
+            }
+            hash_stream h;
+            h.update(buf.data(), n);
+            if (pos)
+                s += ",";
+            s += "{\"weak\":" + std::to_string((a & 0xffff) | (b << 16)) + ",\"md5\":\"" + h.digest() + "\"}";
+        }
+        s += "]}";
+        return s;
+    }
+
+    String make_archive(size_t i)
+    {
+        auto &f = files[i];
+        int64_t sizes[] = { f.size / 2, f.size - f.size / 2 };
+        const char *names[] = { "a.bin", "b.bin" };
+
+        // ustar: 512 byte headers, padded data, 10 KB blocking
+        String out(f.size + 4 * 512 + 2 * 10240, 0);
+        size_t used = 0;
+        auto a = archive_write_new();
+        archive_write_set_format_ustar(a);
+        archive_write_open_memory(a, out.data(), out.size(), &used);
+        auto e = archive_entry_new();
+        for (int k = 0; k < 2; k++)
+        {
+            archive_entry_clear(e);
+            auto name = "packed/" + std::to_string(i) + "/" + names[k];
+            archive_entry_set_pathname(e, name.c_str());
+            archive_entry_set_filetype(e, AE_IFREG);
+            archive_entry_set_perm(e, 0644);
+            archive_entry_set_size(e, sizes[k]);
+            archive_write_header(a, e);
+            String data(sizes[k], 0);
+            auto offset = (i * 2654435761u + f.version * 40503u + k) % pattern_size;
+            for (int64_t p = 0; p < sizes[k]; p += pattern_size)
+                memcpy(data.data() + p, pattern.data() + offset, std::min<int64_t>(pattern_size, sizes[k] - p));
+            archive_write_data(a, data.data(), data.size());
+        }
+        archive_entry_free(e);
+        if (archive_write_close(a) != ARCHIVE_OK)
+            throw SW_RUNTIME_ERROR(String("Cannot make archive: ") + archive_error_string(a));
+        archive_write_free(a);
+        out.resize(used);
+        return out;
+    }
+};
+
+// what the client did after its download was cut
+struct resume_stats
+{
+    int dropped = 0;
+    // the next request started where the cut one stopped
+    int resumed = 0;
+    // the next request started from zero
+    int restarted = 0;
+    // any other offset
+    int misplaced = 0;
+};
+
+// Minimal HTTP/1.1 server: keep-alive, Range and If-None-Match,
+// one thread per connection, joined when the next one is accepted.
+class http_stand_in
+{
+public:
+    http_stand_in(const synthetic_tree &tree)
+        : tree(tree), acceptor(ctx, ip::tcp::endpoint(ip::address_v4::loopback(), 0))
+    {
+        acceptor_thread = std::thread([this] { accept(); });
+    }
+
+    ~http_stand_in()
+    {
+        stopping = true;
+        // wake up the acceptor
+        boost::system::error_code ec;
+        ip::tcp::socket s(ctx);
+        s.connect(acceptor.local_endpoint(), ec);
+        acceptor_thread.join();
+
+        std::list<connection> left;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            for (auto &c : connections)
+                c.s.shutdown(ip::tcp::socket::shutdown_both, ec);
+            left.splice(left.end(), connections);
+        }
+        // serving threads take the lock to record latencies
+        for (auto &c : left)
+            c.t.join();
+    }
+
+    String url() const
+    {
+        return "http://127.0.0.1:" + std::to_string(acceptor.local_endpoint().port());
+    }
+
+    void set_manifest(const String &s)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        manifest = s;
+        hash_stream h;
+        h.update(s.data(), s.size());
+        etag = "\"" + h.digest() + "\"";
+    }
+
+    // per-file latencies in seconds since the last call
+    std::vector<double> take_latencies()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return std::move(latencies);
+    }
+
+    // Cuts the first response for every file after n bytes of the body
+    // and closes the connection. 0 turns it off.
+    void set_drop(int64_t n)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        drop = n;
+        cut.clear();
+        resume = {};
+    }
+
+    resume_stats take_resume_stats()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return std::exchange(resume, {});
+    }
+
+    // body bytes sent by file since the last call
+    std::unordered_map<size_t, int64_t> take_served()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        return std::move(served);
+    }
+
+private:
+    struct connection
+    {
+        ip::tcp::socket s;
+        std::thread t;
+        std::atomic_bool done{ false };
+
+        connection(ip::tcp::socket s) : s(std::move(s)) {}
+    };
+
+    const synthetic_tree &tree;
+    boost::asio::io_context ctx;
+    ip::tcp::acceptor acceptor;
+    std::thread acceptor_thread;
+    std::atomic_bool stopping{ false };
+    std::mutex m;
+    // stable addresses, threads refer to their connection
+    std::list<connection> connections;
+    std::vector<double> latencies;
+    int64_t drop = 0;
+    // file -> offset its response was cut at, -1 after the next request
+    std::unordered_map<size_t, int64_t> cut;
+    resume_stats resume;
+    std::unordered_map<size_t, int64_t> served;
+    String manifest;
+    String etag;
+
+    void accept()
+    {
+        while (!stopping)
+        {
+            ip::tcp::socket s(ctx);
+            boost::system::error_code ec;
+            acceptor.accept(s, ec);
+            if (ec || stopping)
+                continue;
+            s.set_option(ip::tcp::no_delay(true), ec);
+
+            std::list<connection> finished;
+            {
+                std::lock_guard<std::mutex> lk(m);
+                for (auto i = connections.begin(); i != connections.end();)
+                {
+                    auto next = std::next(i);
+                    if (i->done)
+                        finished.splice(finished.end(), connections, i);
+                    i = next;
+                }
+                auto &c = connections.emplace_back(std::move(s));
+                c.t = std::thread([this, &c]
+                {
+                    serve(c.s);
+                    c.done = true;
+                });
+            }
+            for (auto &c : finished)
+                c.t.join();
+        }
+    }
+
+    static String header(const String &head, const String &name)
+    {
+        auto p = boost::ifind_first(head, "\r\n" + name + ":");
+        if (p.empty())
+            return {};
+        auto b = p.end() - head.begin();
+        auto e = head.find("\r\n", b);
+        return boost::trim_copy(head.substr(b, e - b));
+    }
+
+    void serve(ip::tcp::socket &s)
+    {
+        boost::asio::streambuf buf;
+        boost::system::error_code ec;
+        while (!stopping)
+        {
+            auto n = boost::asio::read_until(s, buf, "\r\n\r\n", ec);
+            if (ec)
+                return;
+            auto start = std::chrono::steady_clock::now();
+            String head(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + n);
+            buf.consume(n);
+
+            auto e = head.find(' ', 4);
+            auto target = head.substr(head.find(' ') + 1, e - head.find(' ') - 1);
+            bool ok;
+            if (target.starts_with("/f/"))
+            {
+                ok = serve_file(s, head, std::stoul(target.substr(3)));
+                std::lock_guard<std::mutex> lk(m);
+                latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            }
+            else if (target.starts_with("/s/"))
+            {
+                auto i = std::stoul(target.substr(3));
+                if (i < tree.files.size() && !tree.files[i].signature.empty())
+                    ok = reply(s, "200 OK", {}, tree.files[i].signature);
+                else
+                    ok = reply(s, "404 Not Found", {}, {});
+            }
+            else if (target.ends_with("/manifest.json"))
+                ok = serve_manifest(s, head);
+            else
+                ok = reply(s, "404 Not Found", {}, {});
+            if (!ok || boost::iequals(header(head, "Connection"), "close"))
+                return;
+        }
+    }
+
+    bool reply(ip::tcp::socket &s, const String &status, const String &headers, const String &body)
+    {
+        auto r = "HTTP/1.1 " + status + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+        boost::system::error_code ec;
+        boost::asio::write(s, boost::asio::buffer(r), ec);
+        return !ec;
+    }
+
+    bool serve_manifest(ip::tcp::socket &s, const String &head)
+    {
+        String body, tag;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            body = manifest;
+            tag = etag;
+        }
+        if (header(head, "If-None-Match") == tag)
+            return reply(s, "304 Not Modified", "ETag: " + tag + "\r\n", {});
+        return reply(s, "200 OK", "ETag: " + tag + "\r\n", body);
+    }
+
+    bool serve_file(ip::tcp::socket &s, const String &head, size_t i)
+    {
+        if (i >= tree.files.size())
+            return reply(s, "404 Not Found", {}, {});
+
+        auto size = tree.served_size(i);
+        int64_t from = 0, to = size - 1;
+        String status = "200 OK";
+        String headers = "Accept-Ranges: bytes\r\n";
+        auto range = header(head, "Range");
+        if (range.starts_with("bytes="))
+        {
+            auto d = range.find('-');
+            from = std::stoll(range.substr(6, d - 6));
+            if (d + 1 < range.size())
+                to = std::min<int64_t>(to, std::stoll(range.substr(d + 1)));
+            if (from >= size)
+                return reply(s, "416 Range Not Satisfiable", "Content-Range: bytes */" + std::to_string(size) + "\r\n", {});
+            status = "206 Partial Content";
+            headers += "Content-Range: bytes " + std::to_string(from) + "-" + std::to_string(to) + "/" + std::to_string(size) + "\r\n";
+        }
+
+        auto len = to - from + 1;
+        // last byte to send
+        auto last = to;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            auto c = cut.find(i);
+            if (drop && c == cut.end() && len > drop)
+            {
+                last = from + drop - 1;
+                cut[i] = last + 1;
+                resume.dropped++;
+            }
+            else if (c != cut.end() && c->second != -1)
+            {
+                if (from == c->second)
+                    resume.resumed++;
+                else if (from == 0)
+                    resume.restarted++;
+                else
+                    resume.misplaced++;
+                c->second = -1;
+            }
+            served[i] += last - from + 1;
+        }
+
+        auto r = "HTTP/1.1 " + status + "\r\nContent-Length: " + std::to_string(len) + "\r\n" + headers + "\r\n";
+        boost::system::error_code ec;
+        boost::asio::write(s, boost::asio::buffer(r), ec);
+        std::vector<char> buf(256 << 10);
+        for (auto p = from; p <= last && !ec; p += buf.size())
+        {
+            auto n = (size_t)std::min<int64_t>(buf.size(), last + 1 - p);
+            tree.read(i, p, buf.data(), n);
+            boost::asio::write(s, boost::asio::buffer(buf.data(), n), ec);
+        }
+        if (last != to)
+        {
+            // the client sees a connection closed before Content-Length bytes
+            s.shutdown(ip::tcp::socket::shutdown_both, ec);
+            return false;
+        }
+        return !ec;
+    }
+};
+
+struct run_result
+{
+    String name;
+    double seconds = 0;
+    int64_t bytes = 0;
+    int64_t connections = 0;
+    // time to serve a file request
+    std::vector<double> server_latencies;
+    // time the client spent receiving a file, retries included
+    std::vector<double> client_latencies;
+};
+
+//
+// function definitions
+//
+
+static double percentile(std::vector<double> v, double q)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(q * v.size()))];
+}
+
+// network time by file from the trace records
+static std::map<String, double> network_seconds()
+{
+    const path fn = "metrics.json";
+    write_metrics(fn);
+    ptree p;
+    pt::read_json(fn.string(), p);
+    std::map<String, double> r;
+    for (auto &[_, f] : p.get_child("files"))
+        r[f.get<String>("name")] = f.get<double>("network");
+    return r;
+}
+
+// root - where downloads and the output tree go
+static run_result run(const String &name, const synthetic_tree &tree, http_stand_in &server, const path &root = {})
+{
+    // every run has its own manifest url, they are cached by url for the process
+    ptree data;
+    data.put("redirect", server.url() + "/" + name + "/manifest.json");
+    server.set_manifest(tree.manifest(server.url()));
+    server.take_latencies();
+    auto network = network_seconds();
+
+    run_result r;
+    r.name = name;
+    auto bytes = downloaded_bytes();
+    auto connections = opened_connections();
+    auto start = std::chrono::steady_clock::now();
+    download_files(root / BOOTSTRAP_DOWNLOADS, root / "out", data);
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.bytes = downloaded_bytes() - bytes;
+    r.connections = opened_connections() - connections;
+    r.server_latencies = server.take_latencies();
+    // records are kept over runs, only files received now have grown
+    for (auto &[f, s] : network_seconds())
+    {
+        if (s > network[f])
+            r.client_latencies.push_back(s - network[f]);
+    }
+    return r;
+}
+
+static void report(const run_result &r, size_t files)
+{
+    auto mb = r.bytes / 1024.0 / 1024.0;
+    LOG_INFO(logger, boost::format("%-5s %8.2f s %10.1f MB %8.1f MB/s %9.1f files/s"
+        "  server p50 %7.2f ms p99 %7.2f ms  client p50 %7.2f ms p99 %7.2f ms  %5d requests %4d connections")
+        % r.name % r.seconds % mb % (mb / r.seconds) % (files / r.seconds)
+        % (percentile(r.server_latencies, 0.5) * 1000) % (percentile(r.server_latencies, 0.99) * 1000)
+        % (percentile(r.client_latencies, 0.5) * 1000) % (percentile(r.client_latencies, 0.99) * 1000)
+        % r.server_latencies.size() % r.connections);
+}
+
+int bootstrap_module_main(int argc, char *argv[], const ptree &data)
+{
+    bench_options o;
+    o.parse(argc, argv);
+
+    auto dir = temp_directory_path("bench") / unique_path();
+    fs::create_directories(dir);
+    auto old_dir = fs::current_path();
+    fs::current_path(dir);
+    init();
+    // client side latencies come from the per-file records
+    enable_file_records();
+
+    LOG_INFO(logger, "Generating " << o.files << " files");
+    synthetic_tree tree;
+    tree.generate(o);
+
+    std::vector<run_result> results;
+    int rc = 0;
+    {
+        http_stand_in server(tree);
+        auto want = [&o](const String &s) { return o.scenario == "all" || o.scenario == s; };
+        // warm and stale runs work over the tree left by the cold one
+        results.push_back(run("cold", tree, server));
+        if (want("warm"))
+            results.push_back(run("warm", tree, server));
+        if (want("stale"))
+        {
+            tree.make_stale(o);
+            results.push_back(run("stale", tree, server));
+        }
+        if (want("delta"))
+        {
+            auto changed = tree.make_delta(o);
+            server.take_served();
+            results.push_back(run("delta", tree, server));
+            auto served = server.take_served();
+            const auto bs = synthetic_tree::signature_block_size;
+            int64_t requested = 0, allowed = 0;
+            int whole = 0, mismatched = 0;
+            for (auto i : changed)
+            {
+                auto &f = tree.files[i];
+                // blocks the patch falls into
+                auto first = f.patch_offset / bs * bs;
+                auto end = std::min<int64_t>(f.size, ((f.patch_offset + (int64_t)f.patch.size() - 1) / bs + 1) * bs);
+                requested += served[i];
+                allowed += end - first;
+                if (served[i] > end - first)
+                    whole++;
+                if (hash_file(path("out") / synthetic_tree::check_path(i), hash_algorithm::md5) != f.hash)
+                    mismatched++;
+            }
+            LOG_INFO(logger, "Delta: " << changed.size() << " files changed, " << requested << " bytes requested of "
+                << allowed << " in changed blocks, " << whole << " files requested beyond them, " << mismatched
+                << " digest mismatches");
+            if (whole || mismatched)
+            {
+                LOG_ERROR(logger, "Delta updates requested unchanged blocks or rebuilt wrong files");
+                rc = 1;
+            }
+        }
+        if (want("resume"))
+        {
+            // own downloads dir, so nothing comes from the content store
+            server.set_drop(o.drop);
+            results.push_back(run("resume", tree, server, "resume"));
+            auto rs = server.take_resume_stats();
+            server.set_drop(0);
+            // the manifest is received too
+            int64_t size = tree.manifest(server.url()).size();
+            for (size_t i = 0; i < tree.files.size(); i++)
+                size += tree.served_size(i);
+            LOG_INFO(logger, "Resume: " << rs.dropped << " responses cut after " << o.drop << " bytes, " << rs.resumed
+                << " resumed from the cut, " << rs.restarted << " restarted from zero, " << rs.misplaced
+                << " resumed elsewhere; received " << results.back().bytes << " of " << size << " bytes");
+            if (rs.resumed != rs.dropped || results.back().bytes > size)
+            {
+                LOG_ERROR(logger, "Cut downloads were not resumed from their .part files");
+                rc = 1;
+            }
+        }
+        if (want("repair"))
+        {
+            // every tenth plain file has no digest, a part of them and
+            // of the others is removed or damaged in place
+            std::vector<size_t> removed, damaged;
+            for (size_t i = 0; i < tree.files.size(); i++)
+            {
+                auto &f = tree.files[i];
+                if (f.packed || f.size == 0)
+                    continue;
+                f.unhashed = i % 10 == 0;
+                auto fn = path("out") / synthetic_tree::check_path(i);
+                if (i % 7 == 0)
+                {
+                    fs::remove(fn);
+                    removed.push_back(i);
+                }
+                else if (i % 7 == 1 && !f.unhashed)
+                {
+                    // same write time, so the change is not taken for a local edit
+                    auto lwt = fs::last_write_time(fn);
+                    std::fstream stream(fn, std::ios::in | std::ios::out | std::ios::binary);
+                    auto c = stream.get();
+                    stream.seekp(0);
+                    stream.put(~c);
+                    stream.close();
+                    fs::last_write_time(fn, lwt);
+                    damaged.push_back(i);
+                }
+            }
+            settings.mode = run_mode::repair;
+            results.push_back(run("repair", tree, server));
+            settings.mode = run_mode::normal;
+            int bad = 0;
+            for (auto &l : { removed, damaged })
+            {
+                for (auto i : l)
+                {
+                    auto fn = path("out") / synthetic_tree::check_path(i);
+                    if (!fs::exists(fn) || hash_file(fn, hash_algorithm::md5) != tree.files[i].hash)
+                        bad++;
+                }
+            }
+            for (auto &f : tree.files)
+                f.unhashed = false;
+            LOG_INFO(logger, "Repair: " << removed.size() << " files removed, " << damaged.size() << " damaged, "
+                << bad << " not restored");
+            if (bad)
+            {
+                LOG_ERROR(logger, "Repair did not restore removed or damaged files");
+                rc = 1;
+            }
+        }
+        if (!want("cold"))
+            results.erase(results.begin());
+    }
+
+    for (auto &r : results)
+        report(r, tree.files.size());
+
+    fs::current_path(old_dir);
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    return rc;
+}
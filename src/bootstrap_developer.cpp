@@ -18,11 +18,24 @@
 
 #include "functional.h"
 
+#include "digest.h"
+#include "download.h"
+#include "task_graph.h"
+
 #include <primitives/command.h>
 #include <primitives/hash.h>
 #include <primitives/http.h>
 #include <primitives/pack.h>
 
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+
 #include <primitives/log.h>
 DECLARE_STATIC_LOGGER(logger, "developer");
 
@@ -89,6 +102,22 @@ static void build_project(const path &dir)
     }
 }
 
+static git_options read_git_options(const ptree &p)
+{
+    git_options o;
+    o.url = p.get<String>("url");
+    o.branch = p.get<String>("branch", o.branch);
+    o.filter = p.get<String>("filter", "");
+    o.depth = p.get<int>("depth", 0);
+    o.submodule_jobs = p.get<int>("submodule_jobs", 0);
+    o.shallow_submodules = p.get<bool>("shallow_submodules", false);
+    // a full mirror would silently undo a shallow clone
+    o.mirror = p.get<bool>("mirror", o.filter.empty() && o.depth == 0);
+    if (o.submodule_jobs <= 0)
+        o.submodule_jobs = std::max(1u, std::thread::hardware_concurrency());
+    return o;
+}
+
 static auto git_command(const path &dir, const primitives::command::Arguments &args)
 {
     primitives::command::Arguments s;
@@ -99,74 +128,270 @@ static auto git_command(const path &dir, const primitives::command::Arguments &a
     return s;
 }
 
-void download_submodules(const path &dir)
+// --filter and --depth for fetch and submodule update
+static primitives::command::Arguments history_args(const String &filter, int depth)
+{
+    primitives::command::Arguments a;
+    if (!filter.empty())
+        a.push_back("--filter=" + filter);
+    if (depth > 0)
+        a.push_back("--depth=" + std::to_string(depth));
+    return a;
+}
+
+// Returns output of a git command, empty if it fails.
+static String git_output(const path &dir, const primitives::command::Arguments &args)
 {
-    execute_and_print(git_command(dir, { "submodule", "update", "--init", "--recursive" }));
+    primitives::Command c;
+    c.setArguments(git_command(dir, args));
+    execute_and_print(c, false);
+    if (c.exit_code && c.exit_code.value())
+        return {};
+    return c.out.text;
+}
+
+// url of a submodule is relative to the url of its superproject
+static String resolve_submodule_url(String base, String url)
+{
+    if (url.compare(0, 2, "./") != 0 && url.compare(0, 3, "../") != 0)
+        return url;
+    while (!base.empty() && base.back() == '/')
+        base.pop_back();
+    while (1)
+    {
+        if (url.compare(0, 2, "./") == 0)
+            url = url.substr(2);
+        else if (url.compare(0, 3, "../") == 0)
+        {
+            base = base.substr(0, base.rfind('/'));
+            url = url.substr(3);
+        }
+        else
+            break;
+    }
+    return base + "/" + url;
 }
 
-void download_sources(const String &url, const path &dir)
+// filtered mirrors have other objects, they are kept apart
+static path mirror_path(const String &url, const String &filter = {})
+{
+    hash_stream md5;
+    md5.update(url.data(), url.size());
+    if (!filter.empty())
+    {
+        md5.update("#", 1);
+        md5.update(filter.data(), filter.size());
+    }
+    auto name = path(url).filename().stem().string();
+    auto root = settings.git_mirrors.empty() ? BOOTSTRAP_DOWNLOADS / GIT_MIRRORS : settings.git_mirrors;
+    return fs::absolute(root / (name + "-" + md5.digest().substr(0, 8) + ".git"));
+}
+
+// Creates or refreshes a bare mirror of url, once per run.
+// A filtered mirror is a partial clone itself and serves the filter on.
+// Submodules named in .gitmodules of ref are mirrored into modules/<name>
+// inside it: that is where submodule.alternateLocation=superproject
+// looks for their objects, they are never filtered.
+// Mirrors are never pruned or garbage collected, workspaces may still
+// need objects that left the remote.
+// Checkouts run in parallel and may share submodules: a second caller
+// waits until the mirror is ready.
+static void update_mirror(const path &mirror, const String &url, const String &ref, const String &filter = {})
+{
+    static std::mutex m;
+    static std::map<path, std::unique_ptr<std::mutex>> locks;
+    static std::set<path> refreshed;
+
+    std::mutex *l;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto &p = locks[mirror];
+        if (!p)
+            p = std::make_unique<std::mutex>();
+        l = p.get();
+    }
+    // submodule mirrors are locked inside their parent, never the other way
+    std::lock_guard<std::mutex> mirror_lock(*l);
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if (!refreshed.insert(mirror).second)
+            return;
+    }
+
+    if (!fs::exists(mirror / "objects"))
+    {
+        LOG_INFO(logger, "Creating mirror of " << url);
+        fs::create_directories(mirror.parent_path());
+        // a shared root may be used by another bootstrapper at the same time,
+        // the mirror appears there complete or not at all
+        auto tmp = mirror;
+        tmp += "." + unique_path().string();
+        primitives::command::Arguments clone{ git.string(), "clone", "--mirror" };
+        clone.push_back(history_args(filter, 0));
+        clone.push_back(url);
+        clone.push_back(tmp.string());
+        execute_and_print(clone);
+        execute_and_print(git_command(tmp, { "config", "gc.auto", "0" }));
+        if (!filter.empty())
+            execute_and_print(git_command(tmp, { "config", "uploadpack.allowFilter", "true" }));
+        std::error_code ec;
+        fs::rename(tmp, mirror, ec);
+        if (ec)
+            fs::remove_all(tmp);
+    }
+    else
+    {
+        LOG_INFO(logger, "Refreshing mirror of " << url);
+        execute_and_print(git_command(mirror, { "fetch", "origin" }));
+    }
+
+    auto modules = git_output(mirror, { "config", "--blob", ref + ":.gitmodules", "--get-regexp", "^submodule\\..*\\.url$" });
+    std::istringstream ss(modules);
+    String key, sub_url;
+    while (ss >> key >> sub_url)
+    {
+        // submodule.<name>.url
+        auto name = key.substr(10, key.size() - 10 - 4);
+        update_mirror(mirror / "modules" / name, resolve_submodule_url(url, sub_url), "HEAD");
+    }
+}
+
+// Makes workspace take objects from the mirror, submodules from its modules/.
+static void use_mirror(const path &dir, const path &mirror)
+{
+    auto alternates = dir / ".git" / "objects" / "info" / "alternates";
+    auto objects = (mirror / "objects").generic_string();
+    if (!fs::exists(alternates) || read_file(alternates).find(objects) == String::npos)
+    {
+        fs::create_directories(alternates.parent_path());
+        std::ofstream(alternates, std::ios::app) << objects << "\n";
+    }
+    execute_and_print(git_command(dir, { "config", "submodule.alternateLocation", "superproject" }));
+    // submodules without a mirror are cloned as usual
+    execute_and_print(git_command(dir, { "config", "submodule.alternateErrorStrategy", "info" }));
+}
+
+// later fetches and lazy blob loads keep the filter
+static void set_partial_clone(const path &dir, const String &remote, const String &filter)
+{
+    execute_and_print(git_command(dir, { "config", "remote." + remote + ".promisor", "true" }));
+    execute_and_print(git_command(dir, { "config", "remote." + remote + ".partialclonefilter", filter }));
+}
+
+// Refreshes the mirror and fetches the branch from it as origin/<branch>.
+static void fetch_from_mirror(const path &dir, const git_options &o)
+{
+    auto mirror = mirror_path(o.url, o.filter);
+    update_mirror(mirror, o.url, o.branch, o.filter);
+    use_mirror(dir, mirror);
+    String from = mirror.string();
+    if (!o.filter.empty())
+    {
+        // a filtered fetch makes its source a promisor remote, it needs a name
+        from = "mirror";
+        execute_and_print(git_command(dir, { "config", "remote.mirror.url", mirror.string() }));
+        set_partial_clone(dir, "mirror", o.filter);
+        set_partial_clone(dir, "origin", o.filter);
+    }
+    primitives::command::Arguments fetch{ "fetch", from,
+        "+refs/heads/" + o.branch + ":refs/remotes/origin/" + o.branch };
+    fetch.push_back(history_args(o.filter, 0));
+    execute_and_print(git_command(dir, fetch));
+}
+
+void download_submodules(const path &dir, const git_options &o)
+{
+    primitives::command::Arguments args{ "submodule", "update", "--init", "--recursive",
+        "--jobs", std::to_string(o.submodule_jobs) };
+    args.push_back(history_args(o.filter, o.shallow_submodules ? 1 : 0));
+    execute_and_print(git_command(dir, args));
+}
+
+void download_sources(const git_options &o, const path &dir)
 {
     LOG_INFO(logger, "Downloading latest sources from Github repositories");
-    if (!fs::exists(dir / ".git"))
+    fs::remove(dir / ".gitignore");
+    fs::remove(dir / ".gitmodules");
+    execute_and_print(git_command(dir, { "init" }));
+    execute_and_print(git_command(dir, { "remote", "add", "origin", o.url }));
+    if (o.mirror)
     {
-        fs::remove(dir / ".gitignore");
-        fs::remove(dir / ".gitmodules");
-        execute_and_print(git_command(dir, { "init" }));
-        execute_and_print(git_command(dir, { "remote", "add", "origin", url }));
-        execute_and_print(git_command(dir, { "fetch" }));
-        execute_and_print(git_command(dir, { "reset", "origin/master", "--hard" }));
-        execute_and_print(git_command(dir, { "submodule", "deinit", "-f", "." }));
-        download_submodules(dir);
+        // all objects are on local disk already
+        fetch_from_mirror(dir, o);
     }
     else
-        execute_and_print(git_command(dir, { "clone", url, "." }));
-    download_submodules(dir);
+    {
+        if (!o.filter.empty())
+            set_partial_clone(dir, "origin", o.filter);
+        primitives::command::Arguments fetch{ "fetch", "origin", o.branch };
+        fetch.push_back(history_args(o.filter, o.depth));
+        execute_and_print(git_command(dir, fetch));
+    }
+    execute_and_print(git_command(dir, { "reset", "origin/" + o.branch, "--hard" }));
+    execute_and_print(git_command(dir, { "submodule", "deinit", "-f", "." }));
+    download_submodules(dir, o);
 }
 
-void update_sources(const path &dir)
+void update_sources(const git_options &o, const path &dir)
 {
     LOG_INFO(logger, "Updating latest sources from Github repositories");
-    execute_and_print(git_command(dir, { "pull", "origin", "master" }));
-    download_submodules(dir);
+    if (o.mirror)
+    {
+        fetch_from_mirror(dir, o);
+        execute_and_print(git_command(dir, { "merge", "--no-edit", "origin/" + o.branch }));
+        download_submodules(dir, o);
+        return;
+    }
+    // submodules changed by the pull are fetched in parallel as well;
+    // no --depth here: a shallow checkout stays shallow anyway and a new
+    // depth would cut the history apart from the local branch
+    execute_and_print(git_command(dir, { "-c", "submodule.fetchJobs=" + std::to_string(o.submodule_jobs),
+        "pull", "origin", o.branch }));
+    download_submodules(dir, o);
 }
 
-void git_checkout(const path &dir, const String &url)
+void git_checkout(const path &dir, const git_options &o)
 {
     if (!fs::exists(dir))
         create_directories(dir);
 
     if (!fs::exists(dir / ".git"))
-        download_sources(url, dir);
+        download_sources(o, dir);
     else
-        update_sources(dir);
+        update_sources(o, dir);
 }
 
-int bootstrap_module_main(int argc, char *argv[], const ptree &data)
+// The client archive is replaced on the server under the same name,
+// so a part file is kept only for the md5 it was started for.
+// The md5 is written next to the part file before the transfer.
+static void download_sw_archive(const String &url, const path &file, const String &md5)
 {
-    init();
-    check_version(data.get<int>("bootstrap.version"));
-
-    //
-    auto polygon4 = path(data.get<String>("name") + "Developer");
-    path base_dir = fs::current_path();
-    path polygon4_dir = base_dir / polygon4;
-    path download_dir = base_dir / BOOTSTRAP_DOWNLOADS;
-
-    fs::create_directories(polygon4_dir);
+    auto part = part_file(file);
+    auto part_md5 = path(part) += ".md5";
+    if (fs::exists(part) && (!fs::exists(part_md5) || boost::trim_copy(read_file(part_md5)) != md5))
+    {
+        LOG_INFO(logger, "Removing stale partial download " << part);
+        fs::remove(part);
+    }
+    write_file(part_md5, md5);
 
-    git = primitives::resolve_executable(git);
-    if (!git.empty())
+    auto r = download_file_resumable(url, file);
+    if (r.hash != md5 && r.resumed_from)
     {
-        for (const auto &repo : data.get_child("git"))
-            git_checkout(polygon4_dir / repo.second.get<String>("dir"), repo.second.get<String>("url"));
+        LOG_WARN(logger, "Resumed download of " << file << " is damaged, downloading it again");
+        fs::remove(file);
+        r = download_file_resumable(url, file);
     }
-    else
+    fs::remove(part_md5);
+    if (r.hash != md5)
     {
-        LOG_WARN(logger, "Git was not found. Trying to download files manually.");
-        for (const auto &repo : data.get_child("git"))
-            manual_download_sources(polygon4_dir / repo.second.get<String>("dir"), repo.second);
+        fs::remove(file);
+        throw SW_RUNTIME_ERROR("Bad md5 for sw binary");
     }
+}
 
+static void download_sw_client()
+{
 #ifdef _WIN32
     static auto sw_url = "https://software-network.org/client/sw-master-windows-client.zip"s;
 #elif __APPLE__
@@ -176,7 +401,7 @@ int bootstrap_module_main(int argc, char *argv[], const ptree &data)
 #endif
     auto get_remote_md5 = []()
     {
-        static auto md5 = boost::trim_copy(download_file(sw_url + ".md5"));
+        static auto md5 = boost::trim_copy(download_string(sw_url + ".md5"));
         return md5;
     };
 
@@ -191,17 +416,102 @@ int bootstrap_module_main(int argc, char *argv[], const ptree &data)
 
     if (!fs::exists(BOOTSTRAP_DOWNLOADS / "sw.zip"s) || get_remote_md5() != md5_file(BOOTSTRAP_DOWNLOADS / "sw.zip"s))
     {
-        download_file(sw_url, BOOTSTRAP_DOWNLOADS / "sw.zip"s);
+        download_sw_archive(sw_url, BOOTSTRAP_DOWNLOADS / "sw.zip"s, get_remote_md5());
         unpack_exe();
     }
     if (!fs::exists(BOOTSTRAP_PROGRAMS / "sw.exe"s))
         unpack_exe();
+}
+
+static bool is_inside(const path &p, const path &dir)
+{
+    auto r = p.lexically_normal().lexically_relative(dir.lexically_normal());
+    return !r.empty() && *r.begin() != "..";
+}
+
+int bootstrap_module_main(int argc, char *argv[], const ptree &data)
+{
+    init();
+    check_version(data.get<int>("bootstrap.version"));
 
-    LOG_INFO(logger, "Downloading main developer files...");
-    download_files(download_dir, polygon4, data.get_child("developer"));
+    //
+    auto polygon4 = path(data.get<String>("name") + "Developer");
+    path base_dir = fs::current_path();
+    path polygon4_dir = base_dir / polygon4;
+    path download_dir = base_dir / BOOTSTRAP_DOWNLOADS;
+
+    if (settings.mode != run_mode::plan)
+        fs::create_directories(polygon4_dir);
+
+    if (settings.mode != run_mode::normal)
+    {
+        // sources are checked by git, only downloaded files are verified
+        download_files(download_dir, polygon4, data.get_child("developer"));
+        return 0;
+    }
+
+    git = primitives::resolve_executable(git);
+    if (git.empty())
+        LOG_WARN(logger, "Git was not found. Trying to download files manually.");
+
+    // independent stages run at once, the wall time is about the longest one
+    task_graph stages;
+    std::vector<task_graph::stage_id> sources;
+    std::vector<std::pair<path, task_graph::stage_id>> checkouts;
+    for (const auto &repo : data.get_child("git"))
+    {
+        auto dir = polygon4_dir / repo.second.get<String>("dir");
+        // a repository inside another one is checked out after it
+        std::vector<task_graph::stage_id> deps;
+        for (auto &[d, id] : checkouts)
+        {
+            if (is_inside(dir, d))
+                deps.push_back(id);
+        }
+        task_graph::stage_id id;
+        if (!git.empty())
+        {
+            id = stages.add("Checkout of " + dir.string(), [dir, o = read_git_options(repo.second)]()
+            {
+                git_checkout(dir, o);
+            }, deps);
+        }
+        else
+        {
+            id = stages.add("Download of " + dir.string(), [dir, &repo]()
+            {
+                manual_download_sources(dir, repo.second);
+            }, deps);
+        }
+        checkouts.emplace_back(dir, id);
+        sources.push_back(id);
+    }
+
+    // files go into trees a checkout may own ("dir": "."), git must not
+    // reset or clone there while they are written
+    std::vector<task_graph::stage_id> files_deps;
+    for (auto &[d, id] : checkouts)
+    {
+        if (is_inside(polygon4_dir, d) || is_inside(download_dir, d))
+            files_deps.push_back(id);
+    }
+
+    auto sw = stages.add("sw client", download_sw_client);
+    sources.push_back(stages.add("Developer files", [&download_dir, &polygon4, &data]()
+    {
+        LOG_INFO(logger, "Downloading main developer files...");
+        download_files(download_dir, polygon4, data.get_child("developer"));
+    }, files_deps));
+    auto project = stages.add("Project files", [&polygon4_dir]()
+    {
+        create_project_files(polygon4_dir);
+    }, sources);
+    stages.add("Build", [&polygon4_dir]()
+    {
+        build_project(polygon4_dir);
+    }, { project, sw });
 
-    create_project_files(polygon4_dir);
-    build_project(polygon4_dir);
+    stages.run();
 
     LOG_INFO(logger, "Bootstraped Polygon-4 Developer successfully");
 
@@ -17,6 +17,7 @@
  */
 
 #include "functional.h"
+#include "generation.h"
 
 #include <primitives/log.h>
 DECLARE_STATIC_LOGGER(logger, "release");
@@ -51,14 +52,34 @@ int bootstrap_module_main(int argc, char *argv[], const ptree &data)
     auto base_dir = fs::current_path();
     auto polygon4_dir = base_dir / polygon4;
     auto download_dir = base_dir / BOOTSTRAP_DOWNLOADS;
+    auto &release = data.get_child("release");
+    std::vector<path> content_dirs{ polygon4_dir / "Engine" / "Plugins", polygon4_dir / "Polygon4" / "Plugins" };
 
-    fs::create_directory(polygon4_dir);
-    download_files(download_dir, polygon4, data.get_child("release"));
+    // launchers run us on every start, most of the time there is nothing to do
+    generation_stamp stamp("release");
+    if (settings.mode == run_mode::normal)
+    {
+        if (stamp.up_to_date(release))
+        {
+            LOG_INFO(logger, "Polygon-4 Release is up to date");
+            return 0;
+        }
+        stamp.reset();
+    }
 
-    remove_untracked(data.get_child("release"), polygon4_dir, polygon4_dir / "Engine" / "Plugins");
-    remove_untracked(data.get_child("release"), polygon4_dir, polygon4_dir / "Polygon4" / "Plugins");
+    if (settings.mode != run_mode::plan)
+        fs::create_directory(polygon4_dir);
+    download_files(download_dir, polygon4, release);
 
-    LOG_INFO(logger, "Bootstraped Polygon-4 Release successfully");
+    for (auto &d : content_dirs)
+        remove_untracked(release, polygon4_dir, d);
+
+    if (settings.mode == run_mode::normal)
+    {
+        if (!sync_errors())
+            stamp.save(release, download_dir, polygon4, content_dirs);
+        LOG_INFO(logger, "Bootstraped Polygon-4 Release successfully");
+    }
 
     return 0;
 }
@@ -17,6 +17,7 @@
  */
 
 #include "functional.h"
+#include "generation.h"
 
 #include <primitives/log.h>
 DECLARE_STATIC_LOGGER(logger, "tools");
@@ -49,10 +50,27 @@ int bootstrap_module_main(int argc, char *argv[], const ptree &data)
 
     path base_dir = fs::current_path();
     path download_dir = base_dir / BOOTSTRAP_DOWNLOADS;
+    auto &tools = data.get_child("tools");
 
-    download_files(download_dir, fs::current_path(), data.get_child("tools"));
+    generation_stamp stamp("tools");
+    if (settings.mode == run_mode::normal)
+    {
+        if (stamp.up_to_date(tools))
+        {
+            LOG_INFO(logger, "Polygon-4 Tools are up to date");
+            return 0;
+        }
+        stamp.reset();
+    }
 
-    LOG_INFO(logger, "Bootstraped Polygon-4 Tools successfully");
+    download_files(download_dir, fs::current_path(), tools);
+
+    if (settings.mode == run_mode::normal)
+    {
+        if (!sync_errors())
+            stamp.save(tools, download_dir, base_dir);
+        LOG_INFO(logger, "Bootstraped Polygon-4 Tools successfully");
+    }
 
     return 0;
 }
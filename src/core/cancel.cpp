@@ -0,0 +1,64 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cancel.h"
+
+static thread_local cancellation_token *current_token;
+
+void cancellation_token::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lk(m);
+        flag = true;
+    }
+    cv.notify_all();
+}
+
+void cancellation_token::check() const
+{
+    if (cancelled())
+        throw cancelled_error();
+}
+
+bool cancellation_token::wait_for(std::chrono::steady_clock::duration d)
+{
+    std::unique_lock<std::mutex> lk(m);
+    return !cv.wait_for(lk, d, [this] { return cancelled(); });
+}
+
+cancellation_scope::cancellation_scope(cancellation_token &token)
+    : previous(current_token)
+{
+    current_token = &token;
+}
+
+cancellation_scope::~cancellation_scope()
+{
+    current_token = previous;
+}
+
+cancellation_token *current_cancellation_token()
+{
+    return current_token;
+}
+
+void check_cancelled()
+{
+    if (current_token)
+        current_token->check();
+}
@@ -0,0 +1,86 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+
+//
+// types
+//
+
+// Error after which the rest of the run is pointless,
+// e.g. the server gives out wrong files. Never retried.
+struct fatal_error : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+// Thrown by work interrupted because the run was cancelled.
+struct cancelled_error : std::runtime_error
+{
+    cancelled_error() : std::runtime_error("Cancelled") {}
+};
+
+// Shared by all tasks of one run. Once cancelled it stays cancelled:
+// queued work is dropped and transfers in flight abort themselves.
+class cancellation_token
+{
+public:
+    void cancel();
+    bool cancelled() const { return flag; }
+
+    // throws cancelled_error
+    void check() const;
+
+    // Sleeps for d or until cancelled.
+    // Returns false when cancelled.
+    bool wait_for(std::chrono::steady_clock::duration d);
+
+private:
+    std::atomic_bool flag{ false };
+    std::mutex m;
+    std::condition_variable cv;
+};
+
+// Makes token current for this thread until destroyed.
+class cancellation_scope
+{
+public:
+    cancellation_scope(cancellation_token &token);
+    ~cancellation_scope();
+
+private:
+    cancellation_token *previous;
+};
+
+//
+// function declarations
+//
+
+// token of the task running on this thread, nullptr outside of tasks
+cancellation_token *current_cancellation_token();
+
+// throws cancelled_error if the current task is cancelled
+void check_cancelled();
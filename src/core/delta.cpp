@@ -0,0 +1,235 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "delta.h"
+
+#include "cancel.h"
+#include "digest.h"
+#include "throttle.h"
+#include "trace.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <openssl/evp.h>
+
+#include <string.h>
+#include <unordered_map>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "delta");
+
+// fetching more than this part of the file is left to a full download
+static const double max_missing_ratio = 0.7;
+
+namespace
+{
+
+// rsync weak checksum, can be rolled one byte at a time
+struct rolling_checksum
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    void init(const uint8_t *p, size_t len)
+    {
+        a = b = 0;
+        for (size_t i = 0; i < len; i++)
+        {
+            a += p[i];
+            b += (uint32_t)(len - i) * p[i];
+        }
+    }
+
+    void roll(uint8_t out, uint8_t in, size_t len)
+    {
+        a += in - out;
+        b += a - (uint32_t)len * out;
+    }
+
+    uint32_t digest() const
+    {
+        return (a & 0xffff) | (b << 16);
+    }
+};
+
+std::array<uint8_t, 16> block_md5(const uint8_t *p, size_t len)
+{
+    std::array<uint8_t, 16> md;
+    unsigned int n = 0;
+    EVP_Digest(p, len, md.data(), &n, EVP_md5(), nullptr);
+    return md;
+}
+
+}
+
+void block_signature::load(const ptree &p)
+{
+    block_size = p.get<int64_t>("block_size");
+    size = p.get<int64_t>("size");
+    if (block_size <= 0 || size < 0)
+        throw SW_RUNTIME_ERROR("Bad block signature");
+    for (auto &b : p.get_child("blocks"))
+    {
+        block bl;
+        bl.weak = b.second.get<uint32_t>("weak");
+        String md5;
+        if (!from_hex(b.second.get<String>("md5"), md5) || md5.size() != bl.md5.size())
+            throw SW_RUNTIME_ERROR("Bad md5 in block signature");
+        memcpy(bl.md5.data(), md5.data(), md5.size());
+        blocks.push_back(bl);
+    }
+    if ((int64_t)blocks.size() != (size + block_size - 1) / block_size)
+        throw SW_RUNTIME_ERROR("Bad number of blocks in signature");
+}
+
+download_result download_delta(const String &url, const path &old_file, const path &out, const block_signature &sig,
+    hash_algorithm algo)
+{
+    namespace bip = boost::interprocess;
+
+    const auto bs = (size_t)sig.block_size;
+    auto block_len = [&sig, bs](size_t i)
+    {
+        return (size_t)std::min<int64_t>(bs, sig.size - (int64_t)(i * bs));
+    };
+
+    // where each block of the new file is found in the old one
+    std::vector<int64_t> found(sig.blocks.size(), -1);
+
+    int64_t old_size = fs::file_size(old_file);
+    std::unique_ptr<bip::file_mapping> fm;
+    std::unique_ptr<bip::mapped_region> mr;
+    const uint8_t *old_data = nullptr;
+    if (old_size)
+    {
+        fm = std::make_unique<bip::file_mapping>(old_file.string().c_str(), bip::read_only);
+        mr = std::make_unique<bip::mapped_region>(*fm, bip::read_only);
+        old_data = (const uint8_t *)mr->get_address();
+    }
+
+    // full blocks are searched at any offset by the weak checksum
+    std::unordered_multimap<uint32_t, size_t> weak;
+    for (size_t i = 0; i < sig.blocks.size(); i++)
+    {
+        if (block_len(i) == bs)
+            weak.emplace(sig.blocks[i].weak, i);
+    }
+
+    if (old_size >= (int64_t)bs && !weak.empty())
+    {
+        trace_scope trace(trace_phase::hash);
+        rolling_checksum rc;
+        rc.init(old_data, bs);
+        int64_t o = 0;
+        int64_t checked = 0;
+        while (1)
+        {
+            if (o - checked >= (4 << 20))
+            {
+                check_cancelled();
+                checked = o;
+            }
+            bool matched = false;
+            auto range = weak.equal_range(rc.digest());
+            if (range.first != range.second)
+            {
+                auto md = block_md5(old_data + o, bs);
+                for (auto i = range.first; i != range.second; ++i)
+                {
+                    auto &b = sig.blocks[i->second];
+                    if (found[i->second] == -1 && b.md5 == md)
+                    {
+                        found[i->second] = o;
+                        matched = true;
+                    }
+                }
+            }
+            if (matched)
+            {
+                o += bs;
+                if (o + (int64_t)bs > old_size)
+                    break;
+                rc.init(old_data + o, bs);
+                continue;
+            }
+            if (o + (int64_t)bs >= old_size)
+                break;
+            rc.roll(old_data[o], old_data[o + bs], bs);
+            o++;
+        }
+    }
+
+    // short last block can only be at the same place
+    if (!sig.blocks.empty())
+    {
+        auto last = sig.blocks.size() - 1;
+        auto len = block_len(last);
+        auto o = (int64_t)(last * bs);
+        if (len != bs && o + (int64_t)len <= old_size && block_md5(old_data + o, len) == sig.blocks[last].md5)
+            found[last] = o;
+    }
+
+    int64_t missing = 0;
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        if (found[i] == -1)
+            missing += block_len(i);
+    }
+    LOG_INFO(logger, "Delta for " << old_file << ": " << missing << " of " << sig.size << " bytes to download");
+    if (missing > sig.size * max_missing_ratio)
+        throw SW_RUNTIME_ERROR("Too many changes for a delta update");
+
+    if (out.has_parent_path())
+        fs::create_directories(out.parent_path());
+    std::ofstream ofile(out, std::ios::binary | std::ios::trunc);
+    if (!ofile)
+        throw SW_RUNTIME_ERROR("Cannot open " + out.string());
+
+    hash_stream hash(algo);
+    auto write = [&ofile, &hash](const char *p, size_t n)
+    {
+        throttle_disk(n);
+        ofile.write(p, n);
+        hash.update(p, n);
+    };
+
+    for (size_t i = 0; i < found.size();)
+    {
+        if (found[i] != -1)
+        {
+            write((const char *)old_data + found[i], block_len(i));
+            i++;
+            continue;
+        }
+        // one request for a run of missing blocks
+        auto j = i;
+        int64_t len = 0;
+        while (j < found.size() && found[j] == -1)
+            len += block_len(j++);
+        download_range(url, i * bs, len, write);
+        i = j;
+    }
+
+    ofile.close();
+    if (!ofile)
+        throw SW_RUNTIME_ERROR("Cannot write " + out.string());
+
+    download_result r;
+    r.hash = hash.digest();
+    return r;
+}
@@ -0,0 +1,62 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "download.h"
+#include "functional.h"
+
+#include <array>
+
+//
+// types
+//
+
+// Per-block signature of the new version of a file (see make_signature.py).
+// Json:
+//  {
+//      "block_size": 65536,
+//      "size": 1234567,
+//      "blocks": [ { "weak": 123456789, "md5": "..." }, ... ]
+//  }
+// weak is the rsync rolling checksum of the block.
+struct block_signature
+{
+    struct block
+    {
+        uint32_t weak;
+        std::array<uint8_t, 16> md5;
+    };
+
+    int64_t block_size = 0;
+    int64_t size = 0;
+    std::vector<block> blocks;
+
+    void load(const ptree &p);
+};
+
+//
+// function declarations
+//
+
+// Builds new version of a file into out. Blocks found anywhere in old_file
+// are copied locally, only missing ranges are requested from url.
+// Returns digest of out computed with algo; the caller must check it.
+// Throws if too much of the file has changed for a delta to pay off.
+download_result download_delta(const String &url, const path &old_file, const path &out, const block_signature &sig,
+    hash_algorithm algo = hash_algorithm::md5);
@@ -0,0 +1,269 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "digest.h"
+
+#include "cancel.h"
+#include "trace.h"
+
+#include <blake3.h>
+#include <openssl/evp.h>
+#include <xxhash.h>
+
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <vector>
+
+struct hash_stream::impl
+{
+    std::unique_ptr<EVP_MD_CTX, void (*)(EVP_MD_CTX *)> md5{ nullptr, EVP_MD_CTX_free };
+    std::unique_ptr<XXH3_state_t, XXH_errorcode (*)(XXH3_state_t *)> xxh3{ nullptr, XXH3_freeState };
+    blake3_hasher blake3;
+};
+
+hash_stream::hash_stream(hash_algorithm algorithm)
+    : algo(algorithm), p(std::make_unique<impl>())
+{
+    switch (algo)
+    {
+    case hash_algorithm::md5:
+        p->md5.reset(EVP_MD_CTX_new());
+        break;
+    case hash_algorithm::xxh3:
+        p->xxh3.reset(XXH3_createState());
+        break;
+    case hash_algorithm::blake3:
+        break;
+    }
+    reset();
+}
+
+hash_stream::~hash_stream() = default;
+
+void hash_stream::reset()
+{
+    switch (algo)
+    {
+    case hash_algorithm::md5:
+        EVP_DigestInit_ex(p->md5.get(), EVP_md5(), nullptr);
+        break;
+    case hash_algorithm::xxh3:
+        XXH3_128bits_reset(p->xxh3.get());
+        break;
+    case hash_algorithm::blake3:
+        blake3_hasher_init(&p->blake3);
+        break;
+    }
+}
+
+void hash_stream::update(const void *data, size_t size)
+{
+    switch (algo)
+    {
+    case hash_algorithm::md5:
+        EVP_DigestUpdate(p->md5.get(), data, size);
+        break;
+    case hash_algorithm::xxh3:
+        XXH3_128bits_update(p->xxh3.get(), data, size);
+        break;
+    case hash_algorithm::blake3:
+        blake3_hasher_update(&p->blake3, data, size);
+        break;
+    }
+}
+
+void hash_stream::update_file(const path &fn, int64_t size)
+{
+    std::ifstream ifile(fn, std::ios::binary);
+    std::vector<char> buf(1 << 20);
+    while (size > 0 && ifile)
+    {
+        check_cancelled();
+        ifile.read(buf.data(), std::min<int64_t>(buf.size(), size));
+        update(buf.data(), ifile.gcount());
+        size -= ifile.gcount();
+    }
+    if (size)
+        throw SW_RUNTIME_ERROR("Cannot read " + fn.string());
+}
+
+String hash_stream::digest()
+{
+    switch (algo)
+    {
+    case hash_algorithm::md5:
+    {
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(p->md5.get(), md, &len);
+        return to_hex(md, len);
+    }
+    case hash_algorithm::xxh3:
+    {
+        XXH128_canonical_t c;
+        XXH128_canonicalFromHash(&c, XXH3_128bits_digest(p->xxh3.get()));
+        return make_digest(algo, to_hex(c.digest, sizeof(c.digest)));
+    }
+    case hash_algorithm::blake3:
+    {
+        uint8_t md[BLAKE3_OUT_LEN];
+        blake3_hasher_finalize(&p->blake3, md, sizeof(md));
+        return make_digest(algo, to_hex(md, sizeof(md)));
+    }
+    }
+    return {};
+}
+
+const char *to_string(hash_algorithm a)
+{
+    switch (a)
+    {
+    case hash_algorithm::md5:
+        return "md5";
+    case hash_algorithm::xxh3:
+        return "xxh3";
+    case hash_algorithm::blake3:
+        return "blake3";
+    }
+    return "";
+}
+
+bool parse_hash_algorithm(const String &name, hash_algorithm &a)
+{
+    for (auto i : { hash_algorithm::md5, hash_algorithm::xxh3, hash_algorithm::blake3 })
+    {
+        if (name == to_string(i))
+        {
+            a = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_digest(const String &digest, hash_algorithm &a, String &hex)
+{
+    auto p = digest.find(':');
+    if (p == digest.npos)
+    {
+        a = hash_algorithm::md5;
+        hex = digest;
+        return true;
+    }
+    hex = digest.substr(p + 1);
+    return parse_hash_algorithm(digest.substr(0, p), a);
+}
+
+hash_algorithm digest_algorithm(const String &digest)
+{
+    hash_algorithm a;
+    String hex;
+    if (!parse_digest(digest, a, hex))
+        return hash_algorithm::md5;
+    return a;
+}
+
+String make_digest(hash_algorithm a, const String &hex)
+{
+    if (a == hash_algorithm::md5)
+        return hex;
+    return to_string(a) + String(":") + hex;
+}
+
+String hash_file(const path &fn, hash_algorithm a)
+{
+    trace_scope trace(trace_phase::hash);
+    std::ifstream ifile(fn, std::ios::binary);
+    if (!ifile)
+        throw SW_RUNTIME_ERROR("Cannot open " + fn.string());
+
+    auto read = [&ifile](std::vector<char> &buf)
+    {
+        ifile.read(buf.data(), buf.size());
+        return (size_t)ifile.gcount();
+    };
+
+    // two buffers: one is hashed while the other is being read
+    const size_t buf_size = 4 << 20;
+    std::vector<char> bufs[2];
+    bufs[0].resize(buf_size);
+
+    hash_stream h(a);
+    int64_t total = 0;
+    auto n = read(bufs[0]);
+    for (int i = 0; n; i ^= 1)
+    {
+        // a cancelled run must not wait for a multi-GB file
+        check_cancelled();
+        total += n;
+        if (n < buf_size)
+        {
+            h.update(bufs[i].data(), n);
+            break;
+        }
+        bufs[i ^ 1].resize(buf_size);
+        auto next = std::async(std::launch::async, read, std::ref(bufs[i ^ 1]));
+        h.update(bufs[i].data(), n);
+        n = next.get();
+    }
+    if (ifile.bad())
+        throw SW_RUNTIME_ERROR("Cannot read " + fn.string());
+    trace_hashed_bytes(total);
+    return h.digest();
+}
+
+String to_hex(const uint8_t *data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    String s;
+    s.reserve(size * 2);
+    for (size_t i = 0; i < size; i++)
+    {
+        s += digits[data[i] >> 4];
+        s += digits[data[i] & 0xF];
+    }
+    return s;
+}
+
+static int from_hex(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool from_hex(const String &s, String &out)
+{
+    if (s.size() % 2)
+        return false;
+    out.clear();
+    for (size_t i = 0; i < s.size(); i += 2)
+    {
+        auto h = from_hex(s[i]);
+        auto l = from_hex(s[i + 1]);
+        if (h < 0 || l < 0)
+            return false;
+        out += (char)(h << 4 | l);
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <memory>
+#include <stdint.h>
+
+//
+// types
+//
+
+// Digests are passed around as text: plain hex for md5, as in old
+// manifests and catalogs, and "<algorithm>:<hex>" for the others.
+enum class hash_algorithm : uint8_t
+{
+    md5,
+    // xxh3 128 bit, not cryptographic, used for change detection
+    xxh3,
+    blake3,
+};
+
+// Incremental hash for data that arrives in pieces.
+class hash_stream
+{
+public:
+    hash_stream(hash_algorithm algorithm = hash_algorithm::md5);
+    ~hash_stream();
+
+    hash_algorithm algorithm() const { return algo; }
+
+    void reset();
+    void update(const void *data, size_t size);
+    // feeds first size bytes of the file
+    void update_file(const path &fn, int64_t size);
+    // finishes the digest
+    String digest();
+
+private:
+    struct impl;
+
+    hash_algorithm algo;
+    std::unique_ptr<impl> p;
+};
+
+//
+// function declarations
+//
+
+const char *to_string(hash_algorithm a);
+// returns false for unknown names
+bool parse_hash_algorithm(const String &name, hash_algorithm &a);
+// algorithm of a digest string, md5 when there is no prefix
+hash_algorithm digest_algorithm(const String &digest);
+// "xxh3:<hex>" -> true, a and hex; plain hex -> md5
+bool parse_digest(const String &digest, hash_algorithm &a, String &hex);
+String make_digest(hash_algorithm a, const String &hex);
+
+// Hashes the whole file. Reading of the next block overlaps with
+// hashing of the current one.
+String hash_file(const path &fn, hash_algorithm a);
+
+String to_hex(const uint8_t *data, size_t size);
+// returns false if s is not a valid hex string
+bool from_hex(const String &s, String &out);
@@ -0,0 +1,1002 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "download.h"
+
+#include "cancel.h"
+#include "digest.h"
+#include "scheduler.h"
+#include "throttle.h"
+#include "trace.h"
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <boost/algorithm/string.hpp>
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "download");
+
+namespace
+{
+
+// staging dirs not touched for this long are left by a crashed run
+const auto stale_unpack_age = std::chrono::hours(1);
+
+std::atomic<int64_t> received_bytes;
+std::atomic<int64_t> new_connections;
+// host of the transfer running on this thread
+thread_local String transfer_host;
+
+// Called from write callbacks, so blocking here slows the transfer down.
+void count_received(int64_t n)
+{
+    received_bytes += n;
+    trace_network_bytes(n);
+    throttle_network(transfer_host, n);
+}
+
+// Keeps curl handles of finished transfers per host. A handle holds its
+// open connections, so the next transfer to the same host skips
+// TCP and TLS handshakes. DNS cache, TLS sessions and connections
+// are also shared between all handles.
+class connection_pool
+{
+public:
+    using handle = std::unique_ptr<CURL, std::function<void(CURL *)>>;
+
+    static connection_pool &instance()
+    {
+        static connection_pool p;
+        return p;
+    }
+
+    handle acquire(const String &url)
+    {
+        auto host = url_host(url);
+        CURL *c = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            auto &v = idle[host];
+            if (!v.empty())
+            {
+                c = v.back();
+                v.pop_back();
+            }
+        }
+        if (!c)
+            c = curl_easy_init();
+        if (!c)
+            throw SW_RUNTIME_ERROR("Cannot init curl");
+        return handle(c, [this, host](CURL *c) { release(host, c); });
+    }
+
+    void setup(CURL *c)
+    {
+        curl_easy_setopt(c, CURLOPT_SHARE, sh);
+        curl_easy_setopt(c, CURLOPT_TCP_KEEPALIVE, 1L);
+    }
+
+private:
+    // idle handles kept per host
+    static const size_t max_idle = 32;
+
+    std::mutex m;
+    std::unordered_map<String, std::vector<CURL *>> idle;
+    CURLSH *sh;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+
+    connection_pool()
+    {
+        curl_global_init(CURL_GLOBAL_ALL);
+        sh = curl_share_init();
+        curl_share_setopt(sh, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(sh, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(sh, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    ~connection_pool()
+    {
+        for (auto &[_, v] : idle)
+        {
+            for (auto c : v)
+                curl_easy_cleanup(c);
+        }
+        curl_share_cleanup(sh);
+    }
+
+    void release(const String &host, CURL *c)
+    {
+        long n = 0;
+        if (curl_easy_getinfo(c, CURLINFO_NUM_CONNECTS, &n) == CURLE_OK)
+            new_connections += n;
+        {
+            std::lock_guard<std::mutex> lk(m);
+            auto &v = idle[host];
+            if (v.size() < max_idle)
+            {
+                v.push_back(c);
+                return;
+            }
+        }
+        curl_easy_cleanup(c);
+    }
+
+    static void lock(CURL *, curl_lock_data data, curl_lock_access, void *userptr)
+    {
+        ((connection_pool *)userptr)->locks[data].lock();
+    }
+
+    static void unlock(CURL *, curl_lock_data data, void *userptr)
+    {
+        ((connection_pool *)userptr)->locks[data].unlock();
+    }
+};
+
+struct part_transfer
+{
+    CURL *curl = nullptr;
+    path fn;
+    std::ofstream ofile;
+    hash_stream *hash = nullptr;
+    int64_t offset = 0;
+    long http_code = 0;
+    bool started = false;
+
+    bool start()
+    {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code >= 400)
+            return false;
+        if (offset && http_code != 206)
+        {
+            // server ignored our range, start from the beginning
+            LOG_DEBUG(logger, "Server does not support ranges, restarting " << fn);
+            offset = 0;
+        }
+        hash->reset();
+        if (offset)
+            hash->update_file(fn, offset);
+        ofile.open(fn, offset ? std::ios::binary | std::ios::app : std::ios::binary | std::ios::trunc);
+        started = true;
+        return !!ofile;
+    }
+
+    static size_t write(char *ptr, size_t size, size_t nmemb, void *userdata)
+    {
+        auto &t = *(part_transfer *)userdata;
+        if (!t.started && !t.start())
+            return 0;
+        throttle_disk(size * nmemb);
+        t.ofile.write(ptr, size * nmemb);
+        if (!t.ofile)
+            return 0;
+        t.hash->update(ptr, size * nmemb);
+        count_received(size * nmemb);
+        return size * nmemb;
+    }
+};
+
+// Called by curl many times a second while data flows and about
+// once a second on a stalled connection.
+int abort_if_cancelled(void *clientp, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    auto token = (cancellation_token *)clientp;
+    return token && token->cancelled();
+}
+
+void throw_if_aborted(CURLcode r)
+{
+    if (r == CURLE_ABORTED_BY_CALLBACK)
+        throw cancelled_error();
+}
+
+void set_common_options(CURL *curl, const String &url)
+{
+    curl_easy_reset(curl);
+    connection_pool::instance().setup(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    transfer_host = url_host(url);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+    // treat a connection that stalls for a minute as dropped
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+    // transfers of a cancelled run stop on their own
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, abort_if_cancelled);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, current_cancellation_token());
+}
+
+// Bounded queue of received chunks between curl and libarchive.
+// The writer blocks when the reader falls behind.
+class byte_pipe
+{
+public:
+    // returns false if the reader has failed
+    bool push(const char *data, size_t size)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [this] { return bytes < max_bytes || reader_done; });
+        if (reader_failed)
+            return false;
+        // reader has what it needs, the tail of the archive is only hashed
+        if (reader_done)
+            return true;
+        chunks.emplace_back(data, size);
+        bytes += size;
+        cv.notify_all();
+        return true;
+    }
+
+    // returns false on end of stream
+    bool pop(String &chunk)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [this] { return !chunks.empty() || closed; });
+        if (chunks.empty())
+            return false;
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        bytes -= chunk.size();
+        cv.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+    void finish_reading(bool failed)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        reader_done = true;
+        reader_failed = failed;
+        chunks.clear();
+        bytes = 0;
+        cv.notify_all();
+    }
+
+private:
+    static const size_t max_bytes = 16 * 1024 * 1024;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<String> chunks;
+    size_t bytes = 0;
+    bool closed = false;
+    bool reader_done = false;
+    bool reader_failed = false;
+};
+
+// Extracts archive entries from the pipe into dir as they arrive.
+// Regular files, hard links, symlinks and directories are extracted
+// with their permissions, other entry types are skipped.
+class stream_unpacker
+{
+public:
+    byte_pipe pipe;
+    // extracted files and links relative to dir
+    std::vector<path> files;
+    // directory entries relative to dir, empty ones included
+    std::vector<std::pair<path, int>> dirs;
+    String error;
+    // time spent extracting, not waiting for data
+    std::chrono::steady_clock::duration busy{};
+
+    stream_unpacker(const path &dir)
+        : dir(dir)
+    {
+    }
+
+    static void set_permissions(const path &fn, int perm)
+    {
+#ifndef _WIN32
+        std::error_code ec;
+        fs::permissions(fn, (fs::perms)(perm & 07777), ec);
+#endif
+    }
+
+    void run()
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<archive, decltype(&archive_read_free)> a(archive_read_new(), archive_read_free);
+        archive_read_support_format_all(a.get());
+        archive_read_support_filter_all(a.get());
+
+        try
+        {
+            if (archive_read_open(a.get(), this, nullptr, read, nullptr) != ARCHIVE_OK)
+                throw SW_RUNTIME_ERROR(archive_error_string(a.get()));
+            extract(a.get());
+        }
+        catch (std::exception &e)
+        {
+            error = e.what();
+        }
+        pipe.finish_reading(!error.empty());
+        busy = std::chrono::steady_clock::now() - start - waiting;
+    }
+
+private:
+    path dir;
+    // dir with symlinks resolved
+    path root;
+    String chunk;
+    std::chrono::steady_clock::duration waiting{};
+
+    static la_ssize_t read(archive *, void *data, const void **buffer)
+    {
+        auto &u = *(stream_unpacker *)data;
+        auto start = std::chrono::steady_clock::now();
+        bool ok = u.pipe.pop(u.chunk);
+        u.waiting += std::chrono::steady_clock::now() - start;
+        if (!ok)
+            return 0;
+        *buffer = u.chunk.data();
+        return u.chunk.size();
+    }
+
+    // Relative path of an entry. Entries extracted before must not
+    // redirect it: no directory on the way may be a symlink.
+    path entry_path(const path &p) const
+    {
+        auto name = p.lexically_normal();
+        if (name.empty() || name.is_absolute() || name.has_root_name() || *name.begin() == "..")
+            throw SW_RUNTIME_ERROR("Bad path in archive: " + p.string());
+        auto d = dir;
+        for (auto &c : name.parent_path())
+        {
+            d /= c;
+            std::error_code ec;
+            if (fs::is_symlink(d, ec))
+                throw SW_RUNTIME_ERROR("Bad path in archive, it goes through a symlink: " + p.string());
+        }
+        return name;
+    }
+
+    // resolved against what is extracted so far, links to links included
+    bool inside_tree(const path &p) const
+    {
+        std::error_code ec;
+        auto r = fs::weakly_canonical(p, ec).lexically_relative(root);
+        return !ec && !r.empty() && *r.begin() != "..";
+    }
+
+    void extract(archive *a)
+    {
+        root = fs::weakly_canonical(dir);
+        archive_entry *e;
+        int r;
+        while ((r = archive_read_next_header(a, &e)) == ARCHIVE_OK || r == ARCHIVE_WARN)
+        {
+#ifdef _WIN32
+            auto name = entry_path(archive_entry_pathname_w(e));
+#else
+            auto name = entry_path(archive_entry_pathname(e));
+#endif
+            auto fn = dir / name;
+            // other links were checked against this one, it must stay as it is
+            std::error_code ec;
+            if (fs::is_symlink(fn, ec))
+                throw SW_RUNTIME_ERROR("Bad path in archive, it replaces a symlink: " + name.string());
+            auto perm = (int)archive_entry_perm(e);
+#ifdef _WIN32
+            auto link = archive_entry_hardlink_w(e);
+#else
+            auto link = archive_entry_hardlink(e);
+#endif
+            if (link)
+            {
+                // hard links refer to entries extracted before, their type is not always set
+                fs::create_directories(fn.parent_path());
+                fs::create_hard_link(dir / entry_path(link), fn);
+                files.push_back(name);
+                continue;
+            }
+            switch (archive_entry_filetype(e))
+            {
+            case AE_IFDIR:
+                fs::create_directories(fn);
+                dirs.emplace_back(name, perm);
+                continue;
+            case AE_IFLNK:
+            {
+#ifdef _WIN32
+                path target = archive_entry_symlink_w(e);
+#else
+                path target = archive_entry_symlink(e);
+#endif
+                // a link out of the tree would let later entries write there
+                fs::create_directories(fn.parent_path());
+                if (!inside_tree(fn.parent_path() / target))
+                {
+                    LOG_WARN(logger, "Skipping symlink " << name << " pointing out of the tree: " << target);
+                    continue;
+                }
+                fs::create_symlink(target, fn, ec);
+                if (ec)
+                {
+                    LOG_WARN(logger, "Cannot create symlink " << name << ": " << ec.message());
+                    continue;
+                }
+                files.push_back(name);
+                continue;
+            }
+            case AE_IFREG:
+                break;
+            default:
+                continue;
+            }
+
+            fs::create_directories(fn.parent_path());
+
+            std::ofstream ofile(fn, std::ios::binary | std::ios::trunc);
+            if (!ofile)
+                throw SW_RUNTIME_ERROR("Cannot open " + fn.string());
+            const void *buf;
+            size_t size;
+            la_int64_t offset;
+            while ((r = archive_read_data_block(a, &buf, &size, &offset)) == ARCHIVE_OK)
+            {
+                throttle_disk(size);
+                ofile.seekp(offset);
+                ofile.write((const char *)buf, size);
+            }
+            if (r != ARCHIVE_EOF || !ofile)
+                throw SW_RUNTIME_ERROR("Cannot extract " + name.string() + ": " + archive_error_string(a));
+            ofile.close();
+            set_permissions(fn, perm);
+            files.push_back(name);
+        }
+        if (r != ARCHIVE_EOF)
+            throw SW_RUNTIME_ERROR(archive_error_string(a));
+    }
+};
+
+// archive is verified, moves extracted entries into place
+void move_unpacked(const stream_unpacker &u, const path &staging, const path &output_dir)
+{
+    for (auto &f : u.files)
+    {
+        auto dst = output_dir / f;
+        fs::create_directories(dst.parent_path());
+        std::error_code ec;
+        // a symlink is not replaced by rename on every platform
+        if (fs::is_symlink(dst, ec))
+            fs::remove(dst, ec);
+        fs::rename(staging / f, dst);
+    }
+    for (auto &[d, perm] : u.dirs)
+    {
+        fs::create_directories(output_dir / d);
+        stream_unpacker::set_permissions(output_dir / d, perm);
+    }
+}
+
+bool is_transient_error(CURLcode r)
+{
+    switch (r)
+    {
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+}
+
+int64_t downloaded_bytes()
+{
+    return received_bytes;
+}
+
+int64_t opened_connections()
+{
+    return new_connections;
+}
+
+String download_string(const String &url)
+{
+    struct transfer
+    {
+        String s;
+
+        static size_t write(char *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            auto &t = *(transfer *)userdata;
+            t.s.append(ptr, size * nmemb);
+            count_received(size * nmemb);
+            return size * nmemb;
+        }
+    };
+
+    auto curl = connection_pool::instance().acquire(url);
+    transfer t;
+    set_common_options(curl.get(), url);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, transfer::write);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &t);
+
+    auto r = curl_easy_perform(curl.get());
+    throw_if_aborted(r);
+    long http_code = 0;
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &http_code);
+    if (r != CURLE_OK)
+        throw SW_RUNTIME_ERROR("Cannot download " + url + ": " + curl_easy_strerror(r));
+    if (http_code >= 400)
+        throw SW_RUNTIME_ERROR("Cannot download " + url + ": http code " + std::to_string(http_code));
+    return t.s;
+}
+
+path part_file(const path &file)
+{
+    auto p = file;
+    p += PART_FILE_EXTENSION;
+    return p;
+}
+
+download_result download_file_resumable(const String &url, const path &file, hash_algorithm algo, int max_attempts)
+{
+    trace_scope trace(trace_phase::network);
+    auto part = part_file(file);
+    if (file.has_parent_path())
+        fs::create_directories(file.parent_path());
+
+    std::error_code ec;
+    int64_t resumed_from = fs::exists(part, ec) ? fs::file_size(part, ec) : 0;
+    if (ec)
+        resumed_from = 0;
+    if (resumed_from)
+        LOG_INFO(logger, "Resuming " << file << " from " << resumed_from << " bytes");
+
+    auto curl = connection_pool::instance().acquire(url);
+
+    hash_stream hash(algo);
+    for (int attempt = 1;; attempt++)
+    {
+        part_transfer t;
+        t.curl = curl.get();
+        t.fn = part;
+        t.hash = &hash;
+        t.offset = fs::exists(part, ec) ? fs::file_size(part, ec) : 0;
+        if (ec)
+            t.offset = 0;
+
+        auto range = std::to_string(t.offset) + "-";
+
+        set_common_options(t.curl, url);
+        curl_easy_setopt(t.curl, CURLOPT_WRITEFUNCTION, part_transfer::write);
+        curl_easy_setopt(t.curl, CURLOPT_WRITEDATA, &t);
+        if (t.offset)
+            curl_easy_setopt(t.curl, CURLOPT_RANGE, range.c_str());
+
+        auto r = curl_easy_perform(t.curl);
+        if (!t.started)
+            curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &t.http_code);
+        t.ofile.close();
+        if (t.started)
+            resumed_from = t.offset ? std::max(resumed_from, t.offset) : 0;
+        // received part stays for the next run
+        throw_if_aborted(r);
+
+        if (r == CURLE_OK && t.http_code < 400)
+        {
+            if (!t.started)
+            {
+                hash.reset();
+                // empty body
+                if (t.offset == 0 || t.http_code != 206)
+                {
+                    std::ofstream(part, std::ios::binary | std::ios::trunc);
+                    resumed_from = 0;
+                }
+                else
+                    hash.update_file(part, t.offset);
+            }
+            fs::rename(part, file);
+
+            download_result dr;
+            dr.hash = hash.digest();
+            dr.resumed_from = resumed_from;
+            return dr;
+        }
+
+        if (t.http_code == 416)
+        {
+            // our part is larger than the remote file or otherwise invalid
+            LOG_WARN(logger, "Server rejected range for " << file << ", downloading from scratch");
+            fs::remove(part, ec);
+        }
+        else if (t.http_code >= 400)
+        {
+            throw SW_RUNTIME_ERROR("Cannot download " + url + ": http code " + std::to_string(t.http_code));
+        }
+        else if (!is_transient_error(r))
+        {
+            throw SW_RUNTIME_ERROR("Cannot download " + url + ": " + curl_easy_strerror(r));
+        }
+
+        if (attempt >= max_attempts)
+        {
+            throw SW_RUNTIME_ERROR("Cannot download " + url + " after " + std::to_string(attempt) +
+                " attempts: " + curl_easy_strerror(r));
+        }
+
+        LOG_WARN(logger, "Connection dropped while downloading " << file << ": " << curl_easy_strerror(r) <<
+            ", resuming (" << attempt << ") ...");
+        auto token = current_cancellation_token();
+        if (!token)
+            std::this_thread::sleep_for(std::chrono::seconds(attempt));
+        else if (!token->wait_for(std::chrono::seconds(attempt)))
+            throw cancelled_error();
+    }
+}
+
+http_response download_string_if_modified(const String &url, const String &etag, const String &last_modified)
+{
+    struct transfer
+    {
+        http_response r;
+
+        static size_t write(char *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            auto &t = *(transfer *)userdata;
+            t.r.body.append(ptr, size * nmemb);
+            count_received(size * nmemb);
+            return size * nmemb;
+        }
+
+        static size_t header(char *ptr, size_t size, size_t nitems, void *userdata)
+        {
+            auto &t = *(transfer *)userdata;
+            String h(ptr, size * nitems);
+            boost::trim(h);
+            // new response in a redirect chain
+            if (h.compare(0, 5, "HTTP/") == 0)
+            {
+                t.r.etag.clear();
+                t.r.last_modified.clear();
+            }
+            auto p = h.find(':');
+            if (p != h.npos)
+            {
+                auto name = boost::to_lower_copy(h.substr(0, p));
+                auto value = boost::trim_copy(h.substr(p + 1));
+                if (name == "etag")
+                    t.r.etag = value;
+                else if (name == "last-modified")
+                    t.r.last_modified = value;
+            }
+            return size * nitems;
+        }
+    };
+
+    auto curl = connection_pool::instance().acquire(url);
+    transfer t;
+    set_common_options(curl.get(), url);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, transfer::write);
+    curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &t);
+    curl_easy_setopt(curl.get(), CURLOPT_HEADERFUNCTION, transfer::header);
+    curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &t);
+
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> headers(nullptr, curl_slist_free_all);
+    if (!etag.empty())
+        headers.reset(curl_slist_append(headers.release(), ("If-None-Match: " + etag).c_str()));
+    if (!last_modified.empty())
+        headers.reset(curl_slist_append(headers.release(), ("If-Modified-Since: " + last_modified).c_str()));
+    if (headers)
+        curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers.get());
+
+    auto r = curl_easy_perform(curl.get());
+    curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &t.r.http_code);
+    throw_if_aborted(r);
+    if (r != CURLE_OK)
+        throw SW_RUNTIME_ERROR("Cannot download " + url + ": " + curl_easy_strerror(r));
+    if (t.r.http_code >= 400)
+        throw SW_RUNTIME_ERROR("Cannot download " + url + ": http code " + std::to_string(t.r.http_code));
+    return t.r;
+}
+
+void download_range(const String &url, int64_t offset, int64_t size, const std::function<void(const char *, size_t)> &sink)
+{
+    trace_scope trace(trace_phase::network);
+    struct transfer
+    {
+        CURL *curl;
+        const std::function<void(const char *, size_t)> *sink;
+        int64_t left;
+        bool started = false;
+
+        static size_t write(char *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            auto &t = *(transfer *)userdata;
+            if (!t.started)
+            {
+                long http_code = 0;
+                curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &http_code);
+                // whole file instead of the range is of no use here
+                if (http_code != 206)
+                    return 0;
+                t.started = true;
+            }
+            size_t n = size * nmemb;
+            if ((int64_t)n > t.left)
+                return 0;
+            (*t.sink)(ptr, n);
+            t.left -= n;
+            count_received(n);
+            return n;
+        }
+    };
+
+    if (size <= 0)
+        return;
+
+    auto curl = connection_pool::instance().acquire(url);
+    transfer t;
+    t.curl = curl.get();
+    t.sink = &sink;
+    t.left = size;
+
+    auto range = std::to_string(offset) + "-" + std::to_string(offset + size - 1);
+    set_common_options(t.curl, url);
+    curl_easy_setopt(t.curl, CURLOPT_RANGE, range.c_str());
+    curl_easy_setopt(t.curl, CURLOPT_WRITEFUNCTION, transfer::write);
+    curl_easy_setopt(t.curl, CURLOPT_WRITEDATA, &t);
+
+    auto r = curl_easy_perform(t.curl);
+    throw_if_aborted(r);
+    if (r != CURLE_OK)
+        throw SW_RUNTIME_ERROR("Cannot download range " + range + " of " + url + ": " + curl_easy_strerror(r));
+    if (t.left)
+        throw SW_RUNTIME_ERROR("Short range " + range + " of " + url);
+}
+
+download_result download_and_unpack(const String &url, const path &archive, const path &output_dir, const String &hash,
+    int max_attempts)
+{
+    trace_scope trace(trace_phase::network);
+    fs::create_directories(output_dir);
+    auto staging = output_dir / (UNPACK_STAGING_PREFIX + unique_path().string());
+    stream_unpacker u(staging);
+    auto part = part_file(archive);
+    if (archive.has_parent_path())
+        fs::create_directories(archive.parent_path());
+
+    struct transfer
+    {
+        CURL *curl;
+        stream_unpacker *u;
+        hash_stream hash;
+        std::ofstream ofile;
+        // bytes in the part file
+        int64_t offset = 0;
+        long http_code = 0;
+        bool started = false;
+
+        static size_t write(char *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            auto &t = *(transfer *)userdata;
+            auto n = size * nmemb;
+            if (!t.started)
+            {
+                curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &t.http_code);
+                // bytes given to the unpacker cannot be taken back
+                if (t.http_code >= 400 || (t.offset && t.http_code != 206))
+                    return 0;
+                t.started = true;
+            }
+            throttle_disk(n);
+            t.ofile.write(ptr, n);
+            if (!t.ofile)
+                return 0;
+            t.offset += n;
+            t.hash.update(ptr, n);
+            count_received(n);
+            if (!t.u->pipe.push(ptr, n))
+                return 0;
+            return n;
+        }
+    };
+
+    auto curl = connection_pool::instance().acquire(url);
+    transfer t{ curl.get(), &u, hash_stream(digest_algorithm(hash)) };
+
+    // unpacking is throttled and cancelled along with the transfer
+    std::thread reader([&u, token = current_cancellation_token(), priority = current_io_priority()]
+    {
+        io_priority_scope ps(priority);
+        if (!token)
+            return u.run();
+        cancellation_scope cs(*token);
+        u.run();
+    });
+    bool reader_joined = false;
+    auto join_reader = [&]()
+    {
+        if (reader_joined)
+            return;
+        u.pipe.close();
+        reader.join();
+        reader_joined = true;
+        trace_add(trace_phase::unpack, u.busy);
+    };
+    auto cleanup = [&staging]()
+    {
+        std::error_code ec;
+        fs::remove_all(staging, ec);
+    };
+
+    download_result dr;
+    try
+    {
+        // what an interrupted transfer has received goes to the unpacker first
+        std::error_code ec;
+        if (fs::exists(part, ec) && fs::file_size(part, ec) > 0 && !ec)
+        {
+            LOG_INFO(logger, "Resuming " << url << " from " << fs::file_size(part) << " bytes");
+            std::ifstream ifile(part, std::ios::binary);
+            std::vector<char> buf(1 << 20);
+            while (ifile)
+            {
+                ifile.read(buf.data(), buf.size());
+                auto n = (size_t)ifile.gcount();
+                if (!n)
+                    break;
+                t.hash.update(buf.data(), n);
+                t.offset += n;
+                if (!u.pipe.push(buf.data(), n))
+                {
+                    join_reader();
+                    fs::remove(part, ec);
+                    throw SW_RUNTIME_ERROR("Cannot unpack " + url + ": " + u.error);
+                }
+            }
+            dr.resumed_from = t.offset;
+        }
+        t.ofile.open(part, std::ios::binary | std::ios::app);
+        if (!t.ofile)
+            throw SW_RUNTIME_ERROR("Cannot open " + part.string());
+
+        for (int attempt = 1;; attempt++)
+        {
+            t.started = false;
+            t.http_code = 0;
+            auto from = t.offset;
+            auto range = std::to_string(from) + "-";
+            set_common_options(t.curl, url);
+            curl_easy_setopt(t.curl, CURLOPT_WRITEFUNCTION, transfer::write);
+            curl_easy_setopt(t.curl, CURLOPT_WRITEDATA, &t);
+            curl_easy_setopt(t.curl, CURLOPT_RANGE, from ? range.c_str() : nullptr);
+
+            auto r = curl_easy_perform(t.curl);
+            if (!t.started)
+                curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &t.http_code);
+            t.ofile.flush();
+            // received part stays for the next run
+            throw_if_aborted(r);
+
+            if (!u.error.empty() && r == CURLE_WRITE_ERROR)
+            {
+                // write error is how we stop the transfer when unpacking fails
+                t.ofile.close();
+                fs::remove(part, ec);
+                throw SW_RUNTIME_ERROR("Cannot unpack " + url + ": " + u.error);
+            }
+            if (r == CURLE_OK && t.http_code < 400 && (t.started || from == 0 || t.http_code == 206))
+                break;
+            if (t.http_code == 416 || (from && t.http_code < 400 && t.http_code != 206))
+            {
+                // the part cannot be continued, the next attempt starts over
+                t.ofile.close();
+                fs::remove(part, ec);
+                throw SW_RUNTIME_ERROR("Cannot resume " + url + ": http code " + std::to_string(t.http_code));
+            }
+            if (t.http_code >= 400)
+                throw SW_RUNTIME_ERROR("Cannot download " + url + ": http code " + std::to_string(t.http_code));
+            if (!is_transient_error(r))
+                throw SW_RUNTIME_ERROR("Cannot download " + url + ": " + curl_easy_strerror(r));
+            if (attempt >= max_attempts)
+            {
+                throw SW_RUNTIME_ERROR("Cannot download " + url + " after " + std::to_string(attempt) +
+                    " attempts: " + curl_easy_strerror(r));
+            }
+
+            LOG_WARN(logger, "Connection dropped while downloading " << url << ": " << curl_easy_strerror(r) <<
+                ", resuming (" << attempt << ") ...");
+            auto token = current_cancellation_token();
+            if (!token)
+                std::this_thread::sleep_for(std::chrono::seconds(attempt));
+            else if (!token->wait_for(std::chrono::seconds(attempt)))
+                throw cancelled_error();
+        }
+        t.ofile.close();
+
+        join_reader();
+        if (!u.error.empty())
+        {
+            fs::remove(part, ec);
+            throw SW_RUNTIME_ERROR("Cannot unpack " + url + ": " + u.error);
+        }
+    }
+    catch (...)
+    {
+        join_reader();
+        cleanup();
+        throw;
+    }
+
+    dr.hash = t.hash.digest();
+    std::error_code ec;
+    fs::remove(part, ec);
+    if (dr.hash != hash)
+    {
+        cleanup();
+        return dr;
+    }
+
+    {
+        trace_scope move_trace(trace_phase::unpack);
+        move_unpacked(u, staging, output_dir);
+        cleanup();
+    }
+    return dr;
+}
+
+void remove_stale_unpack_dirs(const path &output_dir)
+{
+    std::error_code ec;
+    if (!fs::is_directory(output_dir, ec))
+        return;
+    auto old = fs::file_time_type::clock::now() - stale_unpack_age;
+    for (auto &e : fs::directory_iterator(output_dir, ec))
+    {
+        if (!e.path().filename().string().starts_with(UNPACK_STAGING_PREFIX))
+            continue;
+        if (!e.is_directory(ec) || e.last_write_time(ec) > old || ec)
+            continue;
+        LOG_INFO(logger, "Removing unfinished extraction " << e.path());
+        fs::remove_all(e.path(), ec);
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "digest.h"
+
+#include <primitives/filesystem.h>
+
+#include <functional>
+#include <stdint.h>
+
+#define PART_FILE_EXTENSION ".part"
+// output_dir/.unpack-<unique>, entries of an archive being extracted
+#define UNPACK_STAGING_PREFIX ".unpack-"
+
+//
+// types
+//
+
+struct download_result
+{
+    // digest of the whole file, computed while bytes arrive
+    String hash;
+    // offset the download was resumed from (0 for a fresh download)
+    int64_t resumed_from = 0;
+};
+
+struct http_response
+{
+    long http_code = 0;
+    String body;
+    String etag;
+    String last_modified;
+};
+
+//
+// function declarations
+//
+
+// file.part
+path part_file(const path &file);
+
+// total bytes received by all transfers of the process
+int64_t downloaded_bytes();
+// connections opened so far, the rest of requests reused kept-alive ones
+int64_t opened_connections();
+
+// All downloads below go through one pool of keep-alive connections.
+
+// GET url into memory
+String download_string(const String &url);
+
+// Conditional GET, http_code is 304 and body is empty when
+// the resource has not changed since etag/last_modified.
+http_response download_string_if_modified(const String &url, const String &etag, const String &last_modified);
+
+// Downloads url to file through file.part. When file.part already exists,
+// only missing bytes are requested with HTTP Range. Dropped connections are
+// resumed up to max_attempts times; after that file.part is kept on disk
+// for the next run and an exception is thrown.
+// The file is hashed on the fly, so there is no need to read it back.
+download_result download_file_resumable(const String &url, const path &file,
+    hash_algorithm algo = hash_algorithm::md5, int max_attempts = 5);
+
+// Downloads size bytes starting at offset. Fails if the server
+// does not support ranges.
+void download_range(const String &url, int64_t offset, int64_t size, const std::function<void(const char *, size_t)> &sink);
+
+// Downloads an archive and extracts it while bytes arrive.
+// Entries are extracted into a staging directory inside output_dir and
+// moved into place only when digest of the whole archive matches, otherwise
+// they are discarded. The archive itself is not kept on disk, only
+// archive.part while it is downloaded: dropped connections are resumed
+// from it, and an interrupted run gives it to the unpacker first next time.
+// The part is removed once the archive is complete.
+download_result download_and_unpack(const String &url, const path &archive, const path &output_dir, const String &hash,
+    int max_attempts = 5);
+
+// Removes staging dirs of download_and_unpack() that a crashed run left
+// in output_dir. Recently changed ones may belong to a running extraction.
+void remove_stale_unpack_dirs(const path &output_dir);
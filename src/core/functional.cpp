@@ -18,14 +18,24 @@
 
 #include "functional.h"
 
+#include "cancel.h"
+#include "delta.h"
+#include "download.h"
+#include "log_sink.h"
+#include "lwt.h"
+#include "manifest.h"
+#include "plan.h"
+#include "scheduler.h"
+#include "store.h"
+#include "trace.h"
+#include "verify.h"
+
 #include <primitives/command.h>
 #include <primitives/hash.h>
 #include <primitives/http.h>
 #include <primitives/pack.h>
 
-#include <boost/asio/io_service.hpp>
-#include <boost/thread.hpp>
-
+#include <algorithm>
 #include <atomic>
 #include <codecvt>
 #include <locale>
@@ -40,12 +50,15 @@ DECLARE_STATIC_LOGGER(logger, "core");
 //
 
 path git = "git";
+bootstrap_settings settings;
 
 const int BOOTSTRAPPER_VERSION = PACKAGE_VERSION_PATCH;
 const int BOOTSTRAP_UPDATER_VERSION = 1;
 const int UNTRACKED_CONTENT_DELETER_VERSION = 2;
 const int BOOTSTRAPPER_TOOLS = 1;
 
+static std::atomic<int64_t> n_sync_errors{ 0 };
+
 //
 // helper functions
 //
@@ -66,276 +79,526 @@ path get_temp_filename(const path &subdir)
 // function definitions
 //
 
-struct repository
+// A part file belongs to the version it was started for, the lwt catalog
+// keeps its digest. Parts of other versions or unknown ones are removed.
+static void remove_stale_part(const path &part, const String &hash, local_lwt &lwt)
 {
-    struct file
+    auto f = lwt.find(part);
+    if ((!f || f->hash != hash) && fs::exists(part))
     {
-        path name;
-        String url;
-        bool packed;
-        path check_path;
-        //time_t lwt;
-        String md5;
+        LOG_INFO(logger, "Removing stale partial download " << part);
+        fs::remove(part);
+    }
+}
 
-        void load(const ptree &p)
-        {
-            url = p.get<String>("url");
-            name = p.get<String>("name", "");
-            md5 = p.get<String>("md5", "");
-            check_path = p.get("check_path", "");
-            packed = p.get<bool>("packed", false);
-        }
-    };
+static void save_part_progress(const path &part, const String &hash, local_lwt &lwt)
+{
+    std::error_code ec;
+    local_lwt::file f;
+    f.hash = hash;
+    f.size = fs::exists(part, ec) ? fs::file_size(part, ec) : 0;
+    if (ec)
+        f.size = 0;
+    lwt.set(part, f);
+}
 
-    path file_prefix;
-    std::vector<file> files;
+// Downloads url to file keeping the progress of an interrupted transfer
+// in the lwt catalog, so the next run continues from file.part.
+static download_result download_file_part(const String &url, const path &file, const String &hash, local_lwt &lwt)
+{
+    auto part = part_file(file);
+    remove_stale_part(part, hash, lwt);
 
-    void load(const ptree &p)
+    download_result r;
+    try
     {
-        file_prefix = p.get("file_prefix", "");
-        const ptree &pfs = p.get_child("files");
-        for (auto &pf : pfs)
-        {
-            file f;
-            f.load(pf.second);
-            files.push_back(f);
-        }
+        save_part_progress(part, hash, lwt);
+        r = download_file_resumable(url, file, digest_algorithm(hash));
+    }
+    catch (...)
+    {
+        save_part_progress(part, hash, lwt);
+        throw;
     }
-};
 
-struct local_lwt
+    lwt.erase(part);
+    return r;
+}
+
+// Downloads file and checks its digest computed during the transfer.
+// A resumed download that does not match is fetched once more
+// from scratch before giving up. An entry without a digest is taken as is.
+static void download_file_checked(const String &url, const path &file, const String &hash, local_lwt &lwt)
 {
-    struct file
+    auto r = download_file_part(url, file, hash, lwt);
+    if (hash.empty())
+        r.hash.clear();
+    if (r.hash != hash && r.resumed_from)
+    {
+        LOG_WARN(logger, "Resumed download of " << file << " is damaged, downloading it again");
+        trace_scope trace(trace_phase::retry);
+        fs::remove(file);
+        r = download_file_part(url, file, hash, lwt);
+    }
+    if (r.hash != hash)
     {
-        String md5;
-        time_t lwt;
+        std::error_code ec;
+        fs::remove(file, ec);
+        throw fatal_error("Wrong file is located on server: " + url + ". Cannot proceed.");
+    }
 
-        void load(const ptree &p)
-        {
-            md5 = p.get<String>("md5", "");
-            lwt = p.get<time_t>("lwt", 0);
-        }
+    local_lwt::file f;
+    f.lwt = fs::last_write_time(file).time_since_epoch().count();
+    f.hash = hash;
+    lwt.set(file, f);
+}
 
-        void save(ptree &p)
-        {
-            p.put("md5", md5);
-            p.put("lwt", lwt);
-        }
-    };
+// Returns digest of the file made with algo, taking it from the lwt catalog
+// when the file was not changed since it was recorded there.
+static String hash_file_cached(const path &file, hash_algorithm algo, local_lwt &lwt)
+{
+    auto file_lwt = fs::last_write_time(file).time_since_epoch().count();
+    auto f = lwt.find(file);
+    if (f && f->lwt == file_lwt && !f->hash.empty() && digest_algorithm(f->hash) == algo)
+        return f->hash;
+
+    local_lwt::file nf;
+    nf.lwt = file_lwt;
+    nf.hash = hash_file(file, algo);
+    lwt.set(file, nf);
+    return nf.hash;
+}
+
+static String hash_file_cached(const path &file, const String &hash, local_lwt &lwt)
+{
+    return hash_file_cached(file, digest_algorithm(hash), lwt);
+}
+
+// entries with the same digest must not download the same blob at once
+static std::mutex &blob_mutex(const String &hash)
+{
+    static std::mutex m;
+    static std::unordered_map<String, std::unique_ptr<std::mutex>> mutexes;
+    std::lock_guard<std::mutex> lk(m);
+    auto &p = mutexes[hash];
+    if (!p)
+        p = std::make_unique<std::mutex>();
+    return *p;
+}
 
-    std::unordered_map<path, file> files;
+// files that took their blob out of the store, by digest;
+// later entries with the same digest are copied from them
+static std::mutex materialized_mutex;
+static std::unordered_map<String, path> materialized;
 
-    void load(const ptree &p)
+static path find_materialized(const String &hash, local_lwt &lwt)
+{
+    path p;
+    {
+        std::lock_guard<std::mutex> lk(materialized_mutex);
+        auto i = materialized.find(hash);
+        if (i == materialized.end())
+            return {};
+        p = i->second;
+    }
+    if (fs::exists(p) && hash_file_cached(p, hash, lwt) == hash)
+        return p;
+    return {};
+}
+
+// Puts file into the content store under dir unless a verified copy
+// is already there, then creates file from the stored blob.
+// Files with the same digest are downloaded once for all entries and
+// workspaces sharing dir.
+// When the file system cannot clone and hard links are off, the blob is
+// moved into the file, so its bytes are not kept twice; other entries
+// of this run with the same digest are copied from that file.
+static void download_file_stored(const path &dir, const String &url, const path &file, const String &hash, local_lwt &lwt)
+{
+    if (hash.empty())
     {
-        for (auto &pf : p)
+        download_file_checked(url, file, hash, lwt);
+        return;
+    }
+
+    auto blob = store_blob_path(dir, hash);
+    std::lock_guard<std::mutex> lk(blob_mutex(hash));
+    bool stored = fs::exists(blob) && hash_file_cached(blob, hash, lwt) == hash;
+    auto source = stored ? path() : find_materialized(hash, lwt);
+    if (!source.empty() && source != file)
+    {
+        LOG_DEBUG(logger, "Copying " << file << " from " << source);
+        materialize_file(source, file);
+    }
+    else if (source.empty())
+    {
+        if (!stored)
+            download_file_checked(url, blob, hash, lwt);
+        else
+            LOG_DEBUG(logger, "Taking " << file << " from the store");
+        if (!materialize_file(blob, file, settings.hardlinks, true))
         {
-            file f;
-            f.load(pf.second);
-            files[pf.first] = f;
+            lwt.erase(blob);
+            std::lock_guard<std::mutex> lk2(materialized_mutex);
+            materialized[hash] = file;
         }
     }
 
-    ptree save()
+    local_lwt::file f;
+    f.lwt = fs::last_write_time(file).time_since_epoch().count();
+    f.hash = hash;
+    lwt.set(file, f);
+}
+
+// Brings an unmodified local file to the new version. When the manifest
+// has a block signature for it, only changed blocks are downloaded.
+static void update_file_stored(const path &dir, const String &url, const String &signature_url, const path &file, const String &hash, local_lwt &lwt)
+{
+    if (!signature_url.empty() && !hash.empty())
     {
-        ptree p;
-        for (auto &f : files)
+        auto blob = store_blob_path(dir, hash);
+        auto tmp = blob;
+        tmp += ".delta";
+        try
         {
-            ptree c;
-            f.second.save(c);
-            p.add_child(ptree::path_type(f.first.string(), '|'), c);
+            std::lock_guard<std::mutex> lk(blob_mutex(hash));
+            if (!fs::exists(blob) || hash_file_cached(blob, hash, lwt) != hash)
+            {
+                block_signature sig;
+                sig.load(load_data(signature_url));
+
+                auto r = download_delta(url, file, tmp, sig, digest_algorithm(hash));
+                if (r.hash != hash)
+                    throw SW_RUNTIME_ERROR("Digest mismatch after delta update");
+                fs::rename(tmp, blob);
+
+                local_lwt::file f;
+                f.lwt = fs::last_write_time(blob).time_since_epoch().count();
+                f.hash = hash;
+                lwt.set(blob, f);
+            }
+        }
+        catch (cancelled_error &)
+        {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            throw;
+        }
+        catch (std::exception &e)
+        {
+            LOG_WARN(logger, "Delta update of " << file << " failed: " << e.what() << ". Downloading whole file.");
+            std::error_code ec;
+            fs::remove(tmp, ec);
         }
-        return p;
     }
+    download_file_stored(dir, url, file, hash, lwt);
+}
 
-    void save(const path &fn)
+static download_result download_and_unpack_part(const String &url, const path &archive, const path &output_dir,
+    const String &hash, local_lwt &lwt)
+{
+    auto part = part_file(archive);
+    remove_stale_part(part, hash, lwt);
+
+    download_result r;
+    try
     {
-        pt::write_json(fn.string(), save());
+        save_part_progress(part, hash, lwt);
+        r = download_and_unpack(url, archive, output_dir, hash);
+    }
+    catch (...)
+    {
+        save_part_progress(part, hash, lwt);
+        throw;
     }
-};
+
+    lwt.erase(part);
+    return r;
+}
+
+// Downloads archive and extracts it on the fly. Extracted files
+// are put into output_dir only when the archive digest matches.
+// Progress is kept in archive.part the same way as for files.
+static void download_and_unpack_checked(const String &url, const path &archive, const path &output_dir,
+    const String &hash, local_lwt &lwt)
+{
+    auto r = download_and_unpack_part(url, archive, output_dir, hash, lwt);
+    if (r.hash != hash && r.resumed_from)
+    {
+        LOG_WARN(logger, "Resumed download of " << url << " is damaged, downloading it again");
+        trace_scope trace(trace_phase::retry);
+        r = download_and_unpack_part(url, archive, output_dir, hash, lwt);
+    }
+    if (r.hash != hash)
+        throw fatal_error("Wrong file is located on server: " + url + ". Cannot proceed.");
+}
+
+// Redirected manifests are parsed straight into the typed form and kept
+// for the rest of the run, release checks the same list several times.
+static std::shared_ptr<const repository> load_repository_cached(const String &url)
+{
+    static std::mutex m;
+    static std::unordered_map<String, std::shared_ptr<const repository>> cached;
+    std::unique_lock<std::mutex> lk(m);
+    auto &r = cached[url];
+    if (!r)
+        r = std::make_shared<const repository>(load_repository(url));
+    return r;
+}
 
 void download_files(const path &dir, const path &output_dir, const ptree &data)
 {
     String redirect = data.get("redirect", "");
     if (!redirect.empty())
     {
-        auto data2 = load_data(redirect);
-        download_files(dir, output_dir, data2);
+        download_files(dir, output_dir, *load_repository_cached(redirect));
         return;
     }
+    repository r;
+    r.load(data);
+    download_files(dir, output_dir, r);
+}
 
-    std::atomic_int errors;
+static void fetch_files(const path &dir, const path &output_dir, const repository &data, bool whole_manifest);
 
-    auto work = [&]()
+void download_files(const path &dir, const path &output_dir, const repository &data)
+{
+    if (!data.redirect.empty())
     {
-        boost::asio::io_service io_service;
-        boost::thread_group threadpool;
-        auto work = std::make_unique<boost::asio::io_service::work>(io_service);
-        for (int i = 0; i < 16; i++)
-            threadpool.create_thread([&io_service, &errors]()
-        {
-            while (1)
-            {
-                try
-                {
-                    io_service.run();
-                }
-                catch (...)
-                {
-                    errors++;
-                    continue;
-                }
-                break;
-            }
-        });
+        download_files(dir, output_dir, *load_repository_cached(data.redirect));
+        return;
+    }
 
-        // create last write time file catalog
-        auto lwt_file = path(BOOTSTRAP_DOWNLOADS) / LAST_WRITE_TIME_DATA;
-        if (!std::ifstream(lwt_file.string()))
-            std::ofstream(lwt_file.string()) << R"({})";
-        auto lwt_data = load_data(lwt_file);
-        std::mutex lwt_mutex;
+    if (settings.mode == run_mode::normal)
+    {
+        fetch_files(dir, output_dir, data, true);
+        return;
+    }
+    if (settings.mode == run_mode::plan)
+    {
+        plan_files(dir, output_dir, data);
+        return;
+    }
+
+    verify_report report;
+    auto bad = verify_files(dir, output_dir, data, settings.mode == run_mode::repair, report);
+    if (settings.mode == run_mode::repair && !bad.files.empty())
+    {
+        LOG_INFO(logger, "Repairing " << bad.files.size() << " file(s)");
+        fetch_files(dir, output_dir, bad, false);
+    }
+}
 
-        String file_prefix = data.get("file_prefix", "");
-        const ptree &files = data.get_child("files");
-        for (auto &repo : files)
+// per-file messages of fetch_files(), a big manifest gives thousands of them
+struct fetch_progress
+{
+    progress_log downloading{ "Downloading" };
+    progress_log updating{ "Updating" };
+    progress_log hashing{ "Calculating digest" };
+    progress_log modified{ "Local modifications, skipping", log_level::warn };
+    progress_log unpacking{ "Downloading and unpacking" };
+
+    void finish()
+    {
+        for (auto p : { &downloading, &updating, &hashing, &modified, &unpacking })
+            p->finish();
+        flush_log();
+    }
+};
+
+// whole_manifest - data is the full list of output_dir, not a part to repair,
+// its blobs replace what output_dir used in the store
+static void fetch_files(const path &dir, const path &output_dir, const repository &data, bool whole_manifest)
+{
+    const int max_attempts = 3;
+    int jobs = settings.jobs ? settings.jobs : (data.jobs ? data.jobs : 32);
+    int connections_per_host = settings.connections_per_host ?
+        settings.connections_per_host : (data.connections_per_host ? data.connections_per_host : 16);
+
+    // failed entries are retried by the scheduler on their own
+    download_scheduler scheduler(jobs, connections_per_host, max_attempts);
+
+    // open last write time file catalog
+    local_lwt lwt;
+    lwt.open(path(BOOTSTRAP_DOWNLOADS) / LAST_WRITE_TIME_JOURNAL);
+    remove_stale_unpack_dirs(output_dir);
+
+    fetch_progress progress;
+    for (auto &repo : data.files)
+    {
+        scheduler.add(repo.size, String(data.str(repo.url)), [&repo, &data, &dir, &output_dir, &lwt, &progress]()
         {
-            io_service.post([&repo, &dir, &file_prefix, &output_dir, &lwt_data, &lwt_mutex]()
+            String url(data.str(repo.url));
+            auto file = dir / (data.file_prefix + String(data.str(repo.name)));
+            auto new_hash = data.digest(repo);
+            auto algo = digest_algorithm(new_hash);
+            String check_path(data.str(repo.check_path));
+            bool packed = repo.packed;
+            String signature(data.str(repo.signature));
+            String old_file_hash;
+
+            if (!check_path.empty() && check_path[0] == '/')
+                check_path = check_path.substr(1);
+
+            file_trace trace((packed ? file : output_dir / check_path).string(), current_task_attempt());
+
+            if (!packed)
             {
-                auto url = repo.second.get<String>("url");
-                auto name = repo.second.get<String>("name", "");
-                auto file = dir / (file_prefix + name);
-                auto new_hash_md5 = repo.second.get<String>("md5", "");
-                String check_path = repo.second.get("check_path", "");
-                bool packed = repo.second.get<bool>("packed", false);
-                String old_file_md5;
-
-                if (!check_path.empty() && check_path[0] == '/')
-                    check_path = check_path.substr(1);
-
-                if (!packed)
+                file = output_dir / check_path;
+                bool file_exists;
+                fs::file_time_type::rep file_lwt = 0;
                 {
-                    file = output_dir / check_path;
-                    bool file_exists = fs::exists(file);
+                    trace_scope stat_trace(trace_phase::stat);
+                    file_exists = fs::exists(file);
                     if (file_exists)
+                        file_lwt = fs::last_write_time(file).time_since_epoch().count();
+                }
+                if (file_exists)
+                {
+                    if (auto f = lwt.find(file))
                     {
-                        auto file_lwt = fs::last_write_time(file).time_since_epoch().count();
-                        if (lwt_data.count(file.string()))
+                        old_file_hash = f->hash;
+
+                        auto old_file_lwt = f->lwt;
+                        if (old_file_lwt == 0)
                         {
-                            auto &file_lwt_data_main = lwt_data.find(file.string())->second;
-                            auto &file_lwt_data = file_lwt_data_main.get_child("lwt");
-                            old_file_md5 = file_lwt_data_main.get("md5", String());
+                            old_file_lwt = file_lwt;
+                        }
+                        else if (old_file_lwt == file_lwt)
+                        {
+                            // catalog keeps md5 from before the manifest got a new hash
+                            auto expected = new_hash;
+                            if (repo.has_md5 && !old_file_hash.empty() &&
+                                digest_algorithm(old_file_hash) == hash_algorithm::md5)
+                                expected = data.md5(repo);
 
-                            auto old_file_lwt = file_lwt_data.get_value<time_t>(0);
-                            if (old_file_lwt == 0)
-                            {
-                                old_file_lwt = file_lwt;
-                            }
-                            else if (old_file_lwt == file_lwt)
+                            if (old_file_hash == expected)
                             {
-                                if (old_file_md5 == new_hash_md5)
-                                    return;
-                                else if (old_file_md5.empty())
+                                if (expected != new_hash)
                                 {
-                                    // no md5 was calculated before
-                                    old_file_md5 = md5_file(file);
+                                    f->hash = new_hash;
+                                    lwt.set(file, *f);
                                 }
+                                return;
                             }
-                            file_lwt_data.put_value(file_lwt);
-                            file_lwt_data_main.put("md5", new_hash_md5);
-                        }
-                        else
-                        {
-                            // no md5 was calculated before
-                            LOG_INFO(logger, "Calculating md5 for " << file);
-                            old_file_md5 = md5_file(file);
-                            if (old_file_md5 == new_hash_md5)
+                            else if (old_file_hash.empty() || digest_algorithm(old_file_hash) != digest_algorithm(expected))
                             {
-                                ptree value;
-                                value.add("lwt", file_lwt);
-                                value.add("md5", old_file_md5);
-
-                                std::lock_guard<std::mutex> g(lwt_mutex);
-                                lwt_data.add_child(ptree::path_type(file.string(), '|'), value);
+                                // no digest of this kind was calculated before
+                                old_file_hash = hash_file(file, algo);
+                            }
+                            else
+                            {
+                                // file is not touched since we put it there,
+                                // but the manifest has a newer version
+                                progress.updating.add(file.string());
+                                update_file_stored(dir, url, signature, file, new_hash, lwt);
+                                return;
                             }
                         }
+                        f->lwt = file_lwt;
+                        f->hash = new_hash;
+                        lwt.set(file, *f);
                     }
-                    if (!file_exists)
+                    else
                     {
-                        LOG_INFO(logger, "Downloading " << file);
-                        download_file(url, file);
-
-                        // file is changed in previous download, so md5 is of new file,
-                        //  not same in condition above!
-                        auto new_file_md5 = md5_file(file);
-
-                        // recheck hash
-                        if (new_file_md5 != new_hash_md5)
+                        // no digest was calculated before
+                        progress.hashing.add(file.string());
+                        old_file_hash = hash_file(file, algo);
+                        if (old_file_hash == new_hash)
                         {
-                            LOG_FATAL(logger, "Wrong file is located on server! Cannot proceed.");
-                            exit_program(1);
+                            local_lwt::file nf;
+                            nf.lwt = file_lwt;
+                            nf.hash = old_file_hash;
+                            lwt.set(file, nf);
                         }
-
-                        auto file_lwt = fs::last_write_time(file);
-                        ptree value;
-                        value.add("lwt", file_lwt.time_since_epoch().count());
-                        value.add("md5", new_file_md5);
-
-                        std::lock_guard<std::mutex> g(lwt_mutex);
-                        lwt_data.add_child(ptree::path_type(file.string(), '|'), value);
-                    }
-                    else if (old_file_md5 != new_hash_md5)
-                    {
-                        LOG_INFO(logger, "File " << file << " has local modifications, skipping");
-                        return;
                     }
-                    return;
                 }
-                if (!fs::exists(file) || md5_file(file) != new_hash_md5)
+                if (!file_exists)
                 {
-                    LOG_INFO(logger, "Downloading " << url);
-                    download_file(url, file);
-
-                    // file is changed in previous download, so md5 is of new file,
-                    //  not same in condition above!
-                    // recheck hash
-                    if (md5_file(file) != new_hash_md5)
-                    {
-                        LOG_FATAL(logger, "Wrong file is located on server! Cannot proceed.");
-                        exit_program(1);
-                    }
-                    unpack_file(file, output_dir);
+                    progress.downloading.add(file.string());
+                    download_file_stored(dir, url, file, new_hash, lwt);
                 }
-                if (!check_path.empty() && !exists(output_dir / check_path))
+                else if (old_file_hash != new_hash)
+                {
+                    progress.modified.add(file.string());
+                    return;
+                }
+                return;
+            }
+            // packed entries are recorded in the catalog by the archive name
+            // once they are extracted, the archive itself is not kept
+            auto f = lwt.find(file);
+            // archives extracted before the manifest got a new hash were recorded by md5
+            bool extracted = f && (f->hash == new_hash || (repo.has_md5 && f->hash == data.md5(repo)));
+            bool check_path_exists, archive_exists;
+            {
+                trace_scope stat_trace(trace_phase::stat);
+                check_path_exists = check_path.empty() || exists(output_dir / check_path);
+                archive_exists = fs::exists(file);
+            }
+            if (extracted && check_path_exists)
+                return;
+
+            if (archive_exists && hash_file_cached(file, algo, lwt) == new_hash)
+            {
+                // archive is left by an older bootstrapper and was extracted by it
+                if (!check_path_exists)
                 {
+                    trace_scope unpack_trace(trace_phase::unpack);
                     unpack_file(file, output_dir);
                 }
-            });
-        }
+            }
+            else
+            {
+                progress.unpacking.add(url);
+                download_and_unpack_checked(url, file, output_dir, new_hash, lwt);
+            }
 
-        // work
-        work.reset();
-        threadpool.join_all();
+            local_lwt::file nf;
+            nf.hash = new_hash;
+            lwt.set(file, nf);
+        }, repo.priority);
+    }
 
-        pt::write_json(lwt_file.string(), lwt_data);
-    };
+    auto errors = scheduler.run();
+    n_sync_errors += errors.size();
+    progress.finish();
+    log_trace_summary();
+    for (auto &e : errors)
+        LOG_ERROR(logger, e.url << ": " << e.message << " (" << e.attempts << " attempt(s))");
+    auto fatal = std::find_if(errors.begin(), errors.end(), [](const auto &e) { return e.fatal; });
+    // may run on a stage thread, the main one exits after the error reaches it
+    if (fatal != errors.end())
+        throw SW_RUNTIME_ERROR(fatal->message);
+    if (!errors.empty())
+    {
+        LOG_ERROR(logger, "Download files ended with " << errors.size() << " error(s)");
+        return;
+    }
 
-    const int max_attempts = 3;
-    int attempts = 0;
-    while (1)
-    {
-        if (attempts == max_attempts)
-            break;
-        errors = 0;
-        work();
-        if (errors == 0)
-            break;
-        LOG_ERROR(logger, "Download files ended with " << errors << " error(s)");
-        LOG_ERROR(logger, "Retrying (" << ++attempts << ") ...");
+    if (whole_manifest)
+    {
+        std::vector<String> hashes;
+        for (auto &repo : data.files)
+        {
+            auto h = data.digest(repo);
+            if (!repo.packed && !h.empty())
+                hashes.push_back(h);
+        }
+        // the store is scanned only when some install uses other blobs now
+        if (set_store_references(dir, output_dir, hashes))
+        {
+            for (auto &blob : prune_store(dir))
+                lwt.erase(blob);
+        }
     }
 }
 
 void init()
 {
+    // a plan does not write anything
+    if (settings.mode == run_mode::plan)
+        return;
     fs::create_directory(BOOTSTRAP_DOWNLOADS);
     fs::create_directory(BOOTSTRAP_PROGRAMS);
 }
@@ -354,23 +617,16 @@ void manual_download_sources(const path &dir, const ptree &data)
 ptree load_data(const String &url)
 {
     static std::unordered_map<String, ptree> cached;
-    if (cached.count(url))
-        return cached[url];
-
-    auto s = download_file(url);
-    ptree pt;
-    std::stringstream ss(s);
-    try
-    {
-        pt::json_parser::read_json(ss, pt);
-    }
-    catch (pt::json_parser_error &e)
+    static std::mutex m;
     {
-        LOG_ERROR(logger, "Json file: " << url << " has errors in its structure!");
-        LOG_ERROR(logger, e.what());
-        LOG_ERROR(logger, "Please, report to the author.");
-        throw;
+        std::lock_guard<std::mutex> lk(m);
+        if (cached.count(url))
+            return cached[url];
     }
+
+    auto pt = load_manifest(url);
+
+    std::lock_guard<std::mutex> lk(m);
     return cached[url] = pt;
 }
 
@@ -400,15 +656,11 @@ void execute_and_print(const primitives::command::Arguments &args, bool exit_on_
 
 void execute_and_print(primitives::Command &c, bool exit_on_error)
 {
-    auto print = [](const String &str, bool eof, String &out_line)
+    // Lines are cut out of the received chunk in place, only a line
+    // split between two chunks is collected in partial.
+    // They are written by the logging thread, prefixed with the current source.
+    auto print = [source = current_log_source()](std::string_view str, bool eof, String &partial)
     {
-        if (eof)
-        {
-            out_line += str;
-            LOG_INFO(logger, out_line);
-            return;
-        }
-
         size_t p = 0;
         while (1)
         {
@@ -418,33 +670,44 @@ void execute_and_print(primitives::Command &c, bool exit_on_error)
             size_t p1 = str.find_first_of("\n", p);
 #endif
             if (p1 == str.npos)
-            {
-                out_line += str.substr(p);
                 break;
+            if (partial.empty())
+                async_log(log_level::info, source, str.substr(p, p1 - p));
+            else
+            {
+                partial.append(str.substr(p, p1 - p));
+                async_log(log_level::info, source, partial);
+                partial.clear();
             }
-            out_line += str.substr(p, p1 - p);
-            LOG_INFO(logger, out_line);
-            out_line.clear();
-
             p = ++p1;
 #ifdef _WIN32
             if (str[p - 1] == '\r' && str.size() > p && str[p] == '\n')
                 p++;
 #endif
         }
+        partial.append(str.substr(p));
+        if (eof && !partial.empty())
+        {
+            async_log(log_level::info, source, partial);
+            partial.clear();
+        }
     };
     String out, err;
     c.out.action = [&out, &print](const String &str, bool eof) { print(str, eof, out); };
     c.err.action = [&err, &print](const String &str, bool eof) { print(str, eof, err); };
 
     c.execute();
-
-    // print
-    LOG_TRACE(logger, "OUT:\n" << c.out.text);
-    LOG_TRACE(logger, "ERR:\n" << c.err.text);
+    // what comes next is logged directly
+    flush_log();
 
     if (c.exit_code && c.exit_code.value() && exit_on_error)
     {
+        // only the main thread may exit, stages pass the error to it
+        if (main_thread_id != std::this_thread::get_id())
+        {
+            throw SW_RUNTIME_ERROR("Command failed with exit code " + std::to_string(c.exit_code.value()) + ": " +
+                c.print());
+        }
         // will die here
         // allowed to fail only after cleanup work
         check_return_code(c.exit_code.value());
@@ -465,42 +728,15 @@ void exit_program(int code)
 {
     if (main_thread_id != std::this_thread::get_id())
         throw std::runtime_error("Exit attempt in non main thread");
+    flush_log();
     printf("Press Enter to continue...");
     getchar();
     exit(1);
 }
 
-void enumerate_files(const path &dir, std::set<path> &files)
+int64_t sync_errors()
 {
-    try
-    {
-        if (!fs::exists(dir) || !fs::is_directory(dir))
-        {
-            std::cerr << "Source directory " << dir.string()
-                << " does not exist or is not a directory." << '\n';
-            return;
-        }
-    }
-    catch (fs::filesystem_error const & e)
-    {
-        std::cerr << e.what() << '\n';
-        return;
-    }
-    for (fs::directory_iterator file(dir); file != fs::directory_iterator(); ++file)
-    {
-        try
-        {
-            path current(file->path());
-            if (fs::is_directory(current))
-                enumerate_files(current, files);
-            else
-                files.insert(canonical(current));
-        }
-        catch (fs::filesystem_error const & e)
-        {
-            std::cerr << e.what() << '\n';
-        }
-    }
+    return n_sync_errors;
 }
 
 void remove_untracked(const ptree &data, const path &dir, const path &content_dir)
@@ -508,42 +744,127 @@ void remove_untracked(const ptree &data, const path &dir, const path &content_di
     String redirect = data.get("redirect", "");
     if (!redirect.empty())
     {
-        auto data2 = load_data(redirect);
-        remove_untracked(data2, dir, content_dir);
+        remove_untracked(*load_repository_cached(redirect), dir, content_dir);
         return;
     }
+    repository r;
+    r.load(data);
+    remove_untracked(r, dir, content_dir);
+}
 
-    LOG_INFO(logger, "Removing untracked files from " << content_dir.string());
+void remove_untracked(const repository &data, const path &dir, const path &content_dir)
+{
+    if (!data.redirect.empty())
+    {
+        remove_untracked(*load_repository_cached(data.redirect), dir, content_dir);
+        return;
+    }
 
-    const ptree &files = data.get_child("files");
+    LOG_INFO(logger, "Removing untracked files from " << content_dir.string());
 
-    std::set<path> actual_files;
-    enumerate_files(content_dir, actual_files);
+    auto &files = data.files;
 
-    std::set<path> package_files;
+    // compare normalized generic strings, both lists sorted
+    auto root = fs::absolute(dir).lexically_normal();
+    std::vector<std::u8string> package_files;
+    package_files.reserve(files.size());
     for (auto &file : files)
     {
-        auto check_path = file.second.get("check_path", "");
-        auto path = dir / check_path;
-        package_files.insert(path);
+        String check_path(data.str(file.check_path));
+        if (!check_path.empty() && check_path[0] == '/')
+            check_path = check_path.substr(1);
+        package_files.push_back((root / check_path).lexically_normal().generic_u8string());
     }
+    std::sort(package_files.begin(), package_files.end());
 
-    std::set<path> to_remove;
-    for (auto &file : actual_files)
+    std::vector<std::u8string> actual_files;
+    for (auto &file : enumerate_files(content_dir))
+        actual_files.push_back(file.generic_u8string());
+    std::sort(actual_files.begin(), actual_files.end());
+
+    std::vector<std::u8string> to_remove;
+    std::set_difference(actual_files.begin(), actual_files.end(),
+        package_files.begin(), package_files.end(), std::back_inserter(to_remove));
+    if (to_remove.empty())
+        return;
+
+    if (settings.mode != run_mode::normal)
     {
-        if (package_files.count(file.string()))
-            continue;
-        to_remove.insert(file);
+        // nothing is deleted when an install is only checked
+        progress_log untracked("untracked");
+        for (auto &f : to_remove)
+            untracked.add(path(f).string());
+        untracked.finish();
+        flush_log();
+        return;
     }
+
+    // delete in parallel batches
+    std::atomic_size_t next{ 0 };
+    std::atomic_int errors{ 0 };
+    progress_log removing("Removing");
+    const size_t batch_size = 256;
+    size_t n_threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < n_threads; i++)
+    {
+        threads.emplace_back([&]()
+        {
+            size_t b;
+            while ((b = next.fetch_add(batch_size)) < to_remove.size())
+            {
+                auto e = std::min(b + batch_size, to_remove.size());
+                for (auto i = b; i < e; i++)
+                {
+                    path f = to_remove[i];
+                    removing.add(f.string());
+                    std::error_code ec;
+                    if (!fs::remove(f, ec) && ec)
+                    {
+                        LOG_ERROR(logger, "cannot remove " << f.string() << ": " << ec.message());
+                        errors++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+    removing.finish();
+    flush_log();
+    n_sync_errors += errors;
+    if (errors)
+        LOG_ERROR(logger, errors << " file(s) were not removed");
+
+    // prune emptied directories bottom-up, children before parents
+    auto content = fs::absolute(content_dir).lexically_normal().generic_u8string();
+    if (!content.empty() && content.back() == u8'/')
+        content.pop_back();
+    std::vector<std::u8string> dirs;
     for (auto &f : to_remove)
     {
-        LOG_INFO(logger, "removing: " << f.string());
-        remove(f);
         auto p = f;
-        while (fs::is_empty(p = p.parent_path()))
+        while (1)
         {
-            LOG_INFO(logger, "removing empty dir: " << p.string());
-            fs::remove_all(p);
+            auto pos = p.rfind(u8'/');
+            if (pos == p.npos)
+                break;
+            p.resize(pos);
+            if (p.size() <= content.size())
+                break;
+            dirs.push_back(p);
         }
     }
+    std::sort(dirs.begin(), dirs.end(), [](const auto &a, const auto &b)
+    {
+        return a.size() > b.size() || (a.size() == b.size() && a < b);
+    });
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+    for (auto &d : dirs)
+    {
+        std::error_code ec;
+        // only empty directories can be removed this way
+        if (fs::remove(path(d), ec))
+            LOG_INFO(logger, "removing empty dir: " << path(d).string());
+    }
 }
@@ -50,19 +50,88 @@ extern const int BOOTSTRAPPER_TOOLS;
 #define BOOTSTRAP_PROGRAMS path("BootstrapPrograms")
 #define BOOTSTRAP_COPY_UPDATER "CopyUpdater"
 
+// old json catalog, converted to LAST_WRITE_TIME_JOURNAL on first use
 #define LAST_WRITE_TIME_DATA "lwt.json"
 
+// BootstrapDownloads/git/<name>-<hash of url>.git, bare mirrors shared by workspaces
+// of one directory; --git-mirrors or POLYGON4_GIT_MIRRORS set a root shared by all
+#define GIT_MIRRORS "git"
+#define GIT_MIRRORS_ENV "POLYGON4_GIT_MIRRORS"
+
 //
 // types
 //
 
 using ptree = pt::ptree;
 
+// typed files list, see manifest.h
+struct repository;
+
+enum class run_mode
+{
+    normal,
+    // check installed files only
+    verify,
+    // check installed files and fetch bad ones again
+    repair,
+    // report what a normal run would do, offline and read-only
+    plan,
+};
+
+// How one repository of the "git" list in Bootstrap.json is cloned,
+// all but url are optional:
+//   "branch": "master"
+//   "filter": "blob:none" - partial clone, blobs are fetched on checkout
+//   "depth": 1 - shallow clone of the given depth
+//   "submodule_jobs": 8 - submodules fetched at once, cores by default
+//   "shallow_submodules": true - submodules are cloned with depth 1
+//   "mirror": false - do not use the shared mirror, see GIT_MIRRORS;
+//                     on by default unless filter or depth is given
+// Filters need uploadpack.allowFilter on the server (github has it)
+// and git 2.36 or newer for submodules.
+// A local bare repository must be given as a file:// url, plain paths
+// are cloned by copying objects and ignore filter and depth.
+// With a mirror, objects of the repository come from it through alternates.
+// The mirror is cloned with the filter and serves it to the workspace,
+// missing blobs are fetched from url. Depth applies to submodules only.
+struct git_options
+{
+    String url;
+    String branch = "master";
+    String filter;
+    int depth = 0;
+    int submodule_jobs = 0;
+    bool shallow_submodules = false;
+    bool mirror = true;
+};
+
+// options from the command line
+struct bootstrap_settings
+{
+    run_mode mode = run_mode::normal;
+    // upper limit of concurrent downloads, 0 - take it from the manifest
+    int jobs = 0;
+    // concurrent connections to one host, 0 - take it from the manifest
+    int connections_per_host = 0;
+    // files may be hard linked from the content store, then an edit
+    // of one copy changes the blob and all other copies
+    bool hardlinks = false;
+    // repair replaces files changed by the user too
+    bool repair_modified = false;
+    // per-file timings summary (json), empty - not written
+    path metrics_file;
+    // chrome trace-event file, empty - not written
+    path trace_file;
+    // root of git mirrors, empty - BootstrapDownloads/git
+    path git_mirrors;
+};
+
 //
 // global data
 //
 
 extern path git;
+extern bootstrap_settings settings;
 extern std::thread::id main_thread_id;
 
 //
@@ -85,15 +154,22 @@ ptree load_data(const path &dir);
 void exit_program(int code);
 void check_return_code(int code);
 void check_version(int version);
-void git_checkout(const path &dir, const String &url);
-void download_sources(const String &url);
-void download_submodules();
-void update_sources();
+void git_checkout(const path &dir, const git_options &o);
+void download_sources(const git_options &o, const path &dir);
+void download_submodules(const path &dir, const git_options &o);
+void update_sources(const git_options &o, const path &dir);
 void manual_download_sources(const path &dir, const ptree &data);
 void download_files(const path &dir, const path &output_dir, const ptree &data);
+void download_files(const path &dir, const path &output_dir, const repository &data);
 
-void enumerate_files(const path &dir, std::set<path> &files);
+// Returns sorted absolute normalized paths of all files under dir.
+// Directories are read in parallel.
+std::vector<path> enumerate_files(const path &dir);
 void remove_untracked(const ptree &data, const path &dir, const path &content_dir);
+void remove_untracked(const repository &data, const path &dir, const path &content_dir);
+// entries download_files() gave up on and files remove_untracked()
+// could not delete, in this process
+int64_t sync_errors();
 
 void execute_and_print(primitives::Command &c, bool exit_on_error = true);
 void execute_and_print(const primitives::command::Arguments &args, bool exit_on_error = true);
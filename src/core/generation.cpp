@@ -0,0 +1,202 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "generation.h"
+
+#include "digest.h"
+#include "manifest.h"
+
+#include <sstream>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "generation");
+
+// magic + format version
+static const String stamp_header = "P4GS 1";
+
+// Bootstrap.json part of the module and the bootstrapper version,
+// a new bootstrapper may sync differently
+static String inline_digest(const ptree &data)
+{
+    std::ostringstream ss;
+    pt::write_json(ss, data, false);
+    ss << version();
+    auto s = ss.str();
+    hash_stream md5;
+    md5.update(s.data(), s.size());
+    return md5.digest();
+}
+
+static int64_t dir_lwt(const path &p)
+{
+    std::error_code ec;
+    auto t = fs::last_write_time(p, ec);
+    if (ec)
+        return 0;
+    return t.time_since_epoch().count();
+}
+
+static path normalized(const path &p)
+{
+    return fs::absolute(p).lexically_normal();
+}
+
+// Adds directories from the one of file up to root. Adding, removing
+// or renaming a file changes the modification time of its directory
+// and of its parents up to the first existing one.
+static void add_parents(std::set<path> &dirs, const path &root, const path &file)
+{
+    auto r = root.native().size();
+    for (auto p = file.parent_path(); !p.empty(); p = p.parent_path())
+    {
+        if (!dirs.insert(p).second || p.native().size() <= r || p == p.parent_path())
+            break;
+    }
+}
+
+generation_stamp::generation_stamp(const String &module)
+    : fn(BOOTSTRAP_DOWNLOADS / GENERATION_STAMPS / (module + ".stamp"))
+{
+}
+
+bool generation_stamp::up_to_date(const ptree &data) const
+{
+    if (!fs::exists(fn))
+        return false;
+    try
+    {
+        return check(data);
+    }
+    catch (std::exception &e)
+    {
+        LOG_DEBUG(logger, "Cannot check " << fn << ": " << e.what());
+        return false;
+    }
+}
+
+bool generation_stamp::check(const ptree &data) const
+{
+    std::istringstream ss(read_file(fn));
+    String line;
+    if (!std::getline(ss, line) || line != stamp_header)
+        return false;
+    if (!std::getline(ss, line) || line != "manifest " + inline_digest(data))
+        return false;
+
+    int64_t dirs = 0;
+    while (std::getline(ss, line))
+    {
+        // "<kind> <value> <rest>", rest is a url or a path
+        auto p1 = line.find(' ');
+        auto p2 = line.find(' ', p1 == line.npos ? p1 : p1 + 1);
+        if (p2 == line.npos)
+            return false;
+        auto kind = line.substr(0, p1);
+        auto value = line.substr(p1 + 1, p2 - p1 - 1);
+        auto rest = line.substr(p2 + 1);
+        if (kind == "url")
+        {
+            if (manifest_digest(rest) != value)
+            {
+                LOG_DEBUG(logger, "Manifest " << rest << " is changed");
+                return false;
+            }
+        }
+        else if (kind == "dir")
+        {
+            auto p = path((const char8_t *)rest.c_str());
+            if (std::to_string(dir_lwt(p)) != value)
+            {
+                LOG_DEBUG(logger, "Directory " << p << " is changed");
+                return false;
+            }
+            dirs++;
+        }
+        else
+            return false;
+    }
+    LOG_DEBUG(logger, "Checked " << dirs << " directories");
+    return true;
+}
+
+void generation_stamp::save(const ptree &data, const path &dir, const path &output_dir,
+    const std::vector<path> &content_dirs) const
+{
+    std::ostringstream ss;
+    ss << stamp_header << "\n";
+    ss << "manifest " << inline_digest(data) << "\n";
+
+    // follow redirects the same way download_files() does
+    repository r;
+    String redirect = data.get("redirect", "");
+    if (redirect.empty())
+        r.load(data);
+    while (!redirect.empty())
+    {
+        ss << "url " << manifest_digest(redirect) << " " << redirect << "\n";
+        r = load_repository(redirect);
+        redirect = r.redirect;
+    }
+
+    // the directory of the stamp is created before its parent is recorded
+    fs::create_directories(fn.parent_path());
+
+    auto root = normalized(dir);
+    auto output_root = normalized(output_dir);
+    std::set<path> dirs;
+    for (auto &f : r.files)
+    {
+        add_parents(dirs, root, (root / (r.file_prefix + String(r.str(f.name)))).lexically_normal());
+        String check_path(r.str(f.check_path));
+        if (!check_path.empty() && check_path[0] == '/')
+            check_path = check_path.substr(1);
+        if (!check_path.empty())
+            add_parents(dirs, output_root, (output_root / check_path).lexically_normal());
+    }
+    // every directory under content roots: a file added to one that holds
+    // no tracked files must still make the untracked scan run
+    for (auto &d : content_dirs)
+    {
+        auto root = normalized(d);
+        dirs.insert(root);
+        std::error_code ec;
+        for (auto i = fs::recursive_directory_iterator(root, ec); !ec && i != fs::recursive_directory_iterator(); i.increment(ec))
+        {
+            if (i->is_directory(ec) && !i->is_symlink(ec))
+                dirs.insert(i->path());
+        }
+    }
+
+    for (auto &d : dirs)
+    {
+        auto s = d.u8string();
+        ss << "dir " << dir_lwt(d) << " " << String(s.begin(), s.end()) << "\n";
+    }
+
+    auto tmp = fn;
+    tmp += ".tmp";
+    write_file(tmp, ss.str());
+    fs::rename(tmp, fn);
+    LOG_DEBUG(logger, "Recorded " << dirs.size() << " directories in " << fn);
+}
+
+void generation_stamp::reset() const
+{
+    std::error_code ec;
+    fs::remove(fn, ec);
+}
@@ -0,0 +1,61 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "functional.h"
+
+#include <stdint.h>
+
+// BootstrapDownloads/generations/<module>.stamp
+#define GENERATION_STAMPS "generations"
+
+//
+// types
+//
+
+// State left by a successful sync of one module: digests of the manifests
+// it was synced from and modification times of the directories holding
+// its files. While the manifests are the same and no file was added,
+// removed or renamed in those directories, another sync would do nothing.
+// Files edited in place are not noticed, a sync keeps local
+// modifications anyway.
+class generation_stamp
+{
+public:
+    generation_stamp(const String &module);
+
+    // Revalidates the manifests with conditional requests and stats
+    // the recorded directories. Nothing is downloaded or parsed.
+    // A missing or damaged stamp is not up to date.
+    bool up_to_date(const ptree &data) const;
+
+    // Records the state after a sync of data into dir and output_dir.
+    // content_dirs are roots cleaned by remove_untracked(), all directories
+    // under them are recorded.
+    void save(const ptree &data, const path &dir, const path &output_dir,
+        const std::vector<path> &content_dirs = {}) const;
+
+    // The next run does a full sync.
+    void reset() const;
+
+private:
+    path fn;
+
+    bool check(const ptree &data) const;
+};
@@ -0,0 +1,283 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log_sink.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "out");
+
+// slots of the queue, power of two
+static const size_t queue_size = 4096;
+// lines of one level and source written by one logger call
+static const size_t max_batch_lines = 64;
+
+namespace
+{
+
+thread_local String log_source;
+
+struct record
+{
+    log_level level;
+    String source;
+    String text;
+};
+
+// Bounded multi-producer queue with a single consumer thread.
+// Every slot has a sequence number telling whose turn it is, so producers
+// only race for the write position and never take a lock.
+class log_queue
+{
+public:
+    static log_queue &instance()
+    {
+        static log_queue q;
+        return q;
+    }
+
+    log_queue()
+        : slots(new slot[queue_size])
+    {
+        for (size_t i = 0; i < queue_size; i++)
+            slots[i].seq = i;
+        consumer = std::thread([this] { run(); });
+    }
+
+    ~log_queue()
+    {
+        flush();
+        stopped = true;
+        wake++;
+        wake.notify_one();
+        consumer.join();
+    }
+
+    void push(log_level level, std::string_view source, std::string_view text)
+    {
+        auto pos = head.load(std::memory_order_relaxed);
+        slot *s;
+        while (1)
+        {
+            s = &slots[pos & (queue_size - 1)];
+            auto seq = s->seq.load(std::memory_order_acquire);
+            auto dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (dif < 0)
+            {
+                // full, the consumer is behind
+                std::this_thread::yield();
+                pos = head.load(std::memory_order_relaxed);
+            }
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+        s->r.level = level;
+        s->r.source.assign(source);
+        s->r.text.assign(text);
+        s->seq.store(pos + 1, std::memory_order_release);
+
+        pushed++;
+        wake++;
+        wake.notify_one();
+    }
+
+    void flush()
+    {
+        auto target = pushed.load();
+        while (1)
+        {
+            auto w = written.load();
+            if (w >= target)
+                break;
+            written.wait(w);
+        }
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<size_t> seq;
+        record r;
+    };
+
+    std::unique_ptr<slot[]> slots;
+    std::atomic<size_t> head{ 0 };
+    size_t tail = 0;
+    std::atomic<uint64_t> pushed{ 0 };
+    std::atomic<uint64_t> written{ 0 };
+    std::atomic<uint32_t> wake{ 0 };
+    std::atomic_bool stopped{ false };
+    std::thread consumer;
+
+    bool pop(record &r)
+    {
+        auto &s = slots[tail & (queue_size - 1)];
+        if (s.seq.load(std::memory_order_acquire) != tail + 1)
+            return false;
+        r.level = s.r.level;
+        std::swap(r.source, s.r.source);
+        std::swap(r.text, s.r.text);
+        s.seq.store(tail + queue_size, std::memory_order_release);
+        tail++;
+        return true;
+    }
+
+    void run()
+    {
+        std::vector<record> batch;
+        while (1)
+        {
+            auto w = wake.load();
+            record r;
+            while (pop(r))
+                batch.push_back(std::move(r));
+            if (batch.empty())
+            {
+                if (stopped)
+                    break;
+                wake.wait(w);
+                continue;
+            }
+            write(batch);
+            written += batch.size();
+            written.notify_all();
+            batch.clear();
+        }
+    }
+
+    // consecutive lines of one level and source go to the logger at once
+    static void write(const std::vector<record> &batch)
+    {
+        String text;
+        for (size_t i = 0; i < batch.size();)
+        {
+            auto &first = batch[i];
+            text.clear();
+            if (!first.source.empty())
+                text += "[" + first.source + "] ";
+            text += first.text;
+            size_t n = 1;
+            for (i++; i < batch.size() && n < max_batch_lines; i++, n++)
+            {
+                auto &r = batch[i];
+                if (r.level != first.level || r.source != first.source)
+                    break;
+                text += "\n";
+                if (!r.source.empty())
+                    text += "[" + r.source + "] ";
+                text += r.text;
+            }
+            switch (first.level)
+            {
+            case log_level::debug:
+                LOG_DEBUG(logger, text);
+                break;
+            case log_level::info:
+                LOG_INFO(logger, text);
+                break;
+            case log_level::warn:
+                LOG_WARN(logger, text);
+                break;
+            case log_level::error:
+                LOG_ERROR(logger, text);
+                break;
+            }
+        }
+    }
+};
+
+}
+
+log_source_scope::log_source_scope(const String &name)
+    : previous(log_source)
+{
+    log_source = name;
+}
+
+log_source_scope::~log_source_scope()
+{
+    log_source = previous;
+}
+
+const String &current_log_source()
+{
+    return log_source;
+}
+
+void async_log(log_level level, std::string_view text)
+{
+    log_queue::instance().push(level, log_source, text);
+}
+
+void async_log(log_level level, std::string_view source, std::string_view text)
+{
+    log_queue::instance().push(level, source, text);
+}
+
+void flush_log()
+{
+    log_queue::instance().flush();
+}
+
+progress_log::progress_log(const String &what, log_level level, int burst, clock::duration interval)
+    : what(what), level(level), burst(burst), interval(interval)
+{
+    next_report = (clock::now() + interval).time_since_epoch().count();
+}
+
+progress_log::~progress_log()
+{
+    finish();
+}
+
+void progress_log::finish()
+{
+    auto n = count.load();
+    auto r = reported.exchange(n);
+    if (n > r)
+        async_log(level, what + ": " + std::to_string(n - r) + " more, " + std::to_string(n) + " in total");
+}
+
+void progress_log::add(std::string_view item)
+{
+    auto n = ++count;
+    if (n <= burst || level >= log_level::warn)
+    {
+        auto r = reported.load();
+        while (r < n && !reported.compare_exchange_weak(r, n))
+            ;
+        async_log(level, what + ": " + String(item));
+        return;
+    }
+
+    // one thread per interval writes the summary
+    auto now = clock::now().time_since_epoch().count();
+    auto due = next_report.load();
+    if (now < due || !next_report.compare_exchange_strong(due, now + interval.count()))
+        return;
+    auto r = reported.exchange(n);
+    async_log(level, what + ": " + std::to_string(n - r) + " more, " + std::to_string(n) + " in total, latest " + String(item));
+}
@@ -0,0 +1,91 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string_view>
+
+//
+// types
+//
+
+enum class log_level
+{
+    debug,
+    info,
+    warn,
+    error,
+};
+
+// Names the output of this thread until destroyed,
+// lines of async_log() get it as a [prefix].
+class log_source_scope
+{
+public:
+    log_source_scope(const String &name);
+    ~log_source_scope();
+
+private:
+    String previous;
+};
+
+// Per-file messages of one kind. The first ones are logged as they are,
+// then one line per interval tells how many came and the latest of them.
+// finish() or the destructor logs the rest.
+// Warnings and errors are never folded, every item is logged in full.
+class progress_log
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    progress_log(const String &what, log_level level = log_level::info, int burst = 16,
+        clock::duration interval = std::chrono::seconds(2));
+    ~progress_log();
+
+    void add(std::string_view item);
+    void finish();
+
+private:
+    String what;
+    log_level level;
+    int burst;
+    clock::duration interval;
+    std::atomic<int64_t> count{ 0 };
+    // count at the last line
+    std::atomic<int64_t> reported{ 0 };
+    std::atomic<clock::rep> next_report;
+};
+
+//
+// function declarations
+//
+
+// Queues a line for the logging thread. Does not block unless the queue
+// is full. Lines of one thread keep their order.
+void async_log(log_level level, std::string_view text);
+void async_log(log_level level, std::string_view source, std::string_view text);
+
+// Waits until everything queued so far is written.
+void flush_log();
+
+const String &current_log_source();
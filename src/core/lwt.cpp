@@ -0,0 +1,415 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lwt.h"
+
+#include "digest.h"
+#include "functional.h"
+#include "trace.h"
+
+#include <boost/crc.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "lwt");
+
+namespace
+{
+
+// magic + format version
+const char journal_header[8] = { 'P', '4', 'L', 'W', 'T', 0, 0, 2 };
+// version 1 had no hash algorithm in records, it is converted on open
+const uint8_t journal_version = 2;
+
+enum record_type : uint8_t
+{
+    record_set,
+    record_erase,
+};
+
+// do not let the journal grow much beyond its live contents
+const size_t compact_min_records = 1024;
+
+// Flushed data reaches the disk, not only the OS cache.
+bool sync_file(FILE *f)
+{
+#ifdef _WIN32
+    return _commit(_fileno(f)) == 0;
+#else
+    return fsync(fileno(f)) == 0;
+#endif
+}
+
+// A rename is durable once its directory is synced (not needed on Windows).
+void sync_dir(const path &dir)
+{
+#ifndef _WIN32
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    ::close(fd);
+#endif
+}
+
+String to_key(const path &p)
+{
+    auto s = p.u8string();
+    return String(s.begin(), s.end());
+}
+
+template <class T>
+void put(String &s, T v)
+{
+    s.append((const char *)&v, sizeof(v));
+}
+
+template <class T>
+bool get(const uint8_t *&p, const uint8_t *end, T &v)
+{
+    if (end - p < (ptrdiff_t)sizeof(v))
+        return false;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return true;
+}
+
+uint32_t crc32(const String &s)
+{
+    boost::crc_32_type crc;
+    crc.process_bytes(s.data(), s.size());
+    return crc.checksum();
+}
+
+// record layout:
+//  u32 payload size, u32 payload crc32, payload
+// payload layout:
+//  u8 type, i64 lwt, i64 size, u8 hash algorithm, u8 hash is binary, u8 hash length, hash, u16 key length, key
+// version 1 payload has no hash algorithm byte (md5 only)
+String make_record(const String &key, const local_lwt::file *f)
+{
+    String s;
+    put<uint8_t>(s, f ? record_set : record_erase);
+    put<int64_t>(s, f ? f->lwt : 0);
+    put<int64_t>(s, f ? f->size : 0);
+
+    auto algo = hash_algorithm::md5;
+    String hash;
+    uint8_t binary = 0;
+    if (f)
+    {
+        String hex;
+        if (parse_digest(f->hash, algo, hex))
+            binary = from_hex(hex, hash);
+        if (!binary)
+        {
+            algo = hash_algorithm::md5;
+            hash = f->hash;
+        }
+    }
+    put<uint8_t>(s, (uint8_t)algo);
+    put<uint8_t>(s, binary);
+    put<uint8_t>(s, (uint8_t)hash.size());
+    s += hash;
+
+    put<uint16_t>(s, (uint16_t)key.size());
+    s += key;
+
+    String r;
+    put<uint32_t>(r, (uint32_t)s.size());
+    put<uint32_t>(r, crc32(s));
+    return r + s;
+}
+
+bool parse_payload(const uint8_t *p, const uint8_t *end, uint8_t version, String &key, local_lwt::file &f, uint8_t &type)
+{
+    int64_t lwt, size;
+    uint8_t algo = (uint8_t)hash_algorithm::md5, binary, hash_size;
+    uint16_t key_size;
+    if (!get(p, end, type) || !get(p, end, lwt) || !get(p, end, size) ||
+        (version > 1 && !get(p, end, algo)) ||
+        !get(p, end, binary) || !get(p, end, hash_size) || end - p < hash_size)
+        return false;
+    if (algo > (uint8_t)hash_algorithm::blake3)
+        return false;
+    f.lwt = (time_t)lwt;
+    f.size = size;
+    f.hash = binary ? make_digest((hash_algorithm)algo, to_hex(p, hash_size)) : String((const char *)p, hash_size);
+    p += hash_size;
+    if (!get(p, end, key_size) || end - p != key_size)
+        return false;
+    key.assign((const char *)p, key_size);
+    return true;
+}
+
+}
+
+local_lwt::~local_lwt()
+{
+    close();
+}
+
+void local_lwt::open(const path &fn)
+{
+    std::lock_guard<std::mutex> g(m);
+    this->fn = fn;
+    files.clear();
+    n_records = 0;
+    read_only = false;
+
+    auto json = fn.parent_path() / LAST_WRITE_TIME_DATA;
+    if (!fs::exists(fn) && fs::exists(json))
+    {
+        import_json(json);
+        compact_locked();
+        fs::remove(json);
+        return;
+    }
+
+    bool outdated = load();
+    if (outdated || (n_records > compact_min_records && n_records > files.size() * 2))
+        compact_locked();
+    else
+        open_journal();
+}
+
+void local_lwt::open_read_only(const path &fn)
+{
+    std::lock_guard<std::mutex> g(m);
+    this->fn = fn;
+    files.clear();
+    n_records = 0;
+    read_only = true;
+
+    auto json = fn.parent_path() / LAST_WRITE_TIME_DATA;
+    if (!fs::exists(fn) && fs::exists(json))
+        import_json(json);
+    else
+        load();
+}
+
+void local_lwt::close()
+{
+    std::lock_guard<std::mutex> g(m);
+    if (!journal)
+        return;
+    // records are flushed one by one, the disk gets them once per run
+    if (!sync_file(journal))
+        LOG_WARN(logger, "Cannot sync " << fn);
+    fclose(journal);
+    journal = nullptr;
+}
+
+std::optional<local_lwt::file> local_lwt::find(const path &p) const
+{
+    trace_scope trace(trace_phase::catalog);
+    std::lock_guard<std::mutex> g(m);
+    auto i = files.find(to_key(p));
+    if (i == files.end())
+        return {};
+    return i->second;
+}
+
+void local_lwt::set(const path &p, const file &f)
+{
+    trace_scope trace(trace_phase::catalog);
+    auto key = to_key(p);
+    std::lock_guard<std::mutex> g(m);
+    files[key] = f;
+    append(key, &f);
+}
+
+void local_lwt::erase(const path &p)
+{
+    trace_scope trace(trace_phase::catalog);
+    auto key = to_key(p);
+    std::lock_guard<std::mutex> g(m);
+    if (files.erase(key))
+        append(key, nullptr);
+}
+
+void local_lwt::compact()
+{
+    std::lock_guard<std::mutex> g(m);
+    compact_locked();
+}
+
+bool local_lwt::load()
+{
+    if (!fs::exists(fn) || fs::file_size(fn) == 0)
+        return false;
+
+    namespace bip = boost::interprocess;
+
+    uint64_t good = 0;
+    uint8_t version;
+    {
+        bip::file_mapping fm(fn.string().c_str(), bip::read_only);
+        bip::mapped_region mr(fm, bip::read_only);
+        auto begin = (const uint8_t *)mr.get_address();
+        auto end = begin + mr.get_size();
+        auto p = begin;
+
+        // magic must match, last byte is the version
+        if (end - p < (ptrdiff_t)sizeof(journal_header) ||
+            memcmp(p, journal_header, sizeof(journal_header) - 1) != 0 ||
+            p[sizeof(journal_header) - 1] == 0 || p[sizeof(journal_header) - 1] > journal_version)
+        {
+            // rewritten by the caller, records appended after garbage would never be read
+            LOG_WARN(logger, "Unknown format of " << fn << ", starting from scratch");
+            return true;
+        }
+        version = p[sizeof(journal_header) - 1];
+        p += sizeof(journal_header);
+        good = p - begin;
+
+        while (p < end)
+        {
+            uint32_t size, crc;
+            if (!get(p, end, size) || !get(p, end, crc) || end - p < size)
+                break;
+            String payload((const char *)p, size);
+            if (crc32(payload) != crc)
+                break;
+
+            String key;
+            file f;
+            uint8_t type;
+            if (!parse_payload(p, p + size, version, key, f, type))
+                break;
+            if (type == record_set)
+                files[key] = f;
+            else
+                files.erase(key);
+
+            p += size;
+            good = p - begin;
+            n_records++;
+        }
+    }
+
+    // drop torn tail of the journal left by an interrupted write
+    if (good != fs::file_size(fn) && !read_only)
+    {
+        LOG_WARN(logger, "Journal " << fn << " has damaged tail, truncating");
+        fs::resize_file(fn, good);
+    }
+    return version != journal_version;
+}
+
+void local_lwt::import_json(const path &json)
+{
+    LOG_INFO(logger, "Converting " << json << " to " << fn);
+    auto p = load_data(json);
+    for (auto &pf : p)
+    {
+        file f;
+        f.hash = pf.second.get<String>("md5", "");
+        f.lwt = pf.second.get<time_t>("lwt", 0);
+        f.size = pf.second.get<int64_t>("size", 0);
+        files[to_key(pf.first)] = f;
+    }
+}
+
+void local_lwt::open_journal()
+{
+    journal_size = fs::exists(fn) ? fs::file_size(fn) : 0;
+    journal = fopen(fn.string().c_str(), "ab");
+    if (!journal)
+        throw SW_RUNTIME_ERROR("Cannot open " + fn.string());
+    if (!journal_size)
+    {
+        if (fwrite(journal_header, sizeof(journal_header), 1, journal) != 1 || fflush(journal) != 0)
+        {
+            fclose(journal);
+            journal = nullptr;
+            std::error_code ec;
+            fs::remove(fn, ec);
+            throw SW_RUNTIME_ERROR("Cannot write " + fn.string());
+        }
+        journal_size = sizeof(journal_header);
+    }
+}
+
+void local_lwt::append(const String &key, const file *f)
+{
+    if (!journal)
+        return;
+
+    auto r = make_record(key, f);
+
+    // flush every record, so it survives if we are killed right after
+    if (fwrite(r.data(), r.size(), 1, journal) != 1 || fflush(journal) != 0)
+    {
+        // part of the record may be there, later ones would never be read after it
+        fclose(journal);
+        journal = nullptr;
+        std::error_code ec;
+        fs::resize_file(fn, journal_size, ec);
+        if (!ec)
+            journal = fopen(fn.string().c_str(), "ab");
+        throw SW_RUNTIME_ERROR("Cannot write " + fn.string());
+    }
+    journal_size += r.size();
+    n_records++;
+}
+
+void local_lwt::compact_locked()
+{
+    if (journal)
+        fclose(journal);
+    journal = nullptr;
+
+    auto tmp = fn;
+    tmp += ".tmp";
+    {
+        auto f = fopen(tmp.string().c_str(), "wb");
+        if (!f)
+            throw SW_RUNTIME_ERROR("Cannot open " + tmp.string());
+        bool ok = fwrite(journal_header, sizeof(journal_header), 1, f) == 1;
+        for (auto &[k, v] : files)
+        {
+            auto r = make_record(k, &v);
+            ok &= fwrite(r.data(), r.size(), 1, f) == 1;
+        }
+        ok &= fflush(f) == 0;
+        // the old journal is replaced only by one that is on the disk
+        ok &= sync_file(f);
+        ok &= fclose(f) == 0;
+        if (!ok)
+        {
+            std::error_code ec;
+            fs::remove(tmp, ec);
+            throw SW_RUNTIME_ERROR("Cannot write " + tmp.string());
+        }
+    }
+    fs::rename(tmp, fn);
+    sync_dir(fn.parent_path());
+    n_records = files.size();
+
+    open_journal();
+}
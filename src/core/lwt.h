@@ -0,0 +1,90 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <mutex>
+#include <optional>
+#include <stdint.h>
+#include <stdio.h>
+#include <unordered_map>
+
+#define LAST_WRITE_TIME_JOURNAL "lwt.db"
+
+//
+// types
+//
+
+// Last write time catalog of verified files.
+//
+// Stored as an append-only binary journal: every change is one record
+// flushed to disk immediately, so an interrupted run keeps its progress.
+// The journal is synced on close(), a compacted one before it replaces
+// the old one.
+// The journal is memory-mapped on open, the last record of a file wins.
+// Records that were superseded are dropped by compaction.
+class local_lwt
+{
+public:
+    struct file
+    {
+        // digest in the form of digest.h, the record keeps its algorithm
+        String hash;
+        time_t lwt = 0;
+        // bytes received so far (for .part files)
+        int64_t size = 0;
+    };
+
+    local_lwt() = default;
+    local_lwt(const local_lwt &) = delete;
+    local_lwt &operator=(const local_lwt &) = delete;
+    ~local_lwt();
+
+    // Loads the journal. Old lwt.json catalog next to it is imported once.
+    void open(const path &fn);
+    // Loads the journal without writing to it, changes stay in memory.
+    void open_read_only(const path &fn);
+    void close();
+
+    std::optional<file> find(const path &p) const;
+    void set(const path &p, const file &f);
+    void erase(const path &p);
+
+    // rewrites the journal with live records only
+    void compact();
+
+private:
+    std::unordered_map<String, file> files;
+    mutable std::mutex m;
+    path fn;
+    FILE *journal = nullptr;
+    // bytes of whole records in the journal
+    int64_t journal_size = 0;
+    size_t n_records = 0;
+    bool read_only = false;
+
+    // Returns true if the journal must be rewritten: it has an older format
+    // or an unknown (torn) header, appending to it would hide new records.
+    bool load();
+    void import_json(const path &json);
+    void append(const String &key, const file *f);
+    void open_journal();
+    void compact_locked();
+};
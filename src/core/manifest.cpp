@@ -0,0 +1,898 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "manifest.h"
+
+#include "cancel.h"
+#include "digest.h"
+#include "download.h"
+
+#include <ctype.h>
+#include <limits>
+#include <mutex>
+#include <string.h>
+#include <unordered_set>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "manifest");
+
+namespace
+{
+
+// magic + format version
+const char binary_header[8] = { 'P', '4', 'P', 'T', 0, 0, 0, 1 };
+
+// magic + format version
+const char repository_header[8] = { 'P', '4', 'R', 'P', 0, 0, 0, 4 };
+// bytes of one file entry in the repository cache
+const uint32_t file_record_size = 5 * sizeof(uint32_t) + 16 + sizeof(int64_t) + sizeof(int32_t) + 1;
+// flags byte of a file entry
+const uint8_t file_has_md5 = 1;
+const uint8_t file_packed = 2;
+
+// urls revalidated by this process, a manifest is requested once per run
+std::mutex revalidated_mutex;
+std::unordered_set<String> revalidated;
+
+String body_digest(const String &body)
+{
+    hash_stream md5;
+    md5.update(body.data(), body.size());
+    return md5.digest();
+}
+
+struct cache_entry
+{
+    String url;
+    path json;
+    path bin;
+    path repo;
+    path meta;
+
+    cache_entry(const String &url)
+        : url(url)
+    {
+        hash_stream md5;
+        md5.update(url.data(), url.size());
+        // anchored at the working directory like the other download paths
+        auto base = fs::current_path() / BOOTSTRAP_DOWNLOADS / MANIFEST_CACHE / md5.digest();
+        json = base;
+        json += ".json";
+        bin = base;
+        bin += ".bin";
+        repo = base;
+        repo += ".repo";
+        meta = base;
+        meta += ".meta";
+    }
+
+    // Revalidates cached copy. Returns true if there is a new body
+    // in the cache, pre-parsed forms of an old one are removed then.
+    // A plan run takes the cached copy as is.
+    bool fetch()
+    {
+        if (settings.mode == run_mode::plan)
+        {
+            if (!fs::exists(json))
+                throw SW_RUNTIME_ERROR("Manifest " + url + " is not cached, --plan needs one normal run first");
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lk(revalidated_mutex);
+            if (revalidated.count(url))
+                return false;
+        }
+        auto r = revalidate();
+        std::lock_guard<std::mutex> lk(revalidated_mutex);
+        revalidated.insert(url);
+        return r;
+    }
+
+    // md5 of the cached body, kept in meta
+    String digest() const
+    {
+        ptree m;
+        if (fs::exists(meta))
+            pt::read_json(meta.string(), m);
+        auto d = m.get("digest", "");
+        if (!d.empty())
+            return d;
+        // meta written before digests were kept
+        d = body_digest(read_file(json));
+        m.put("url", url);
+        m.put("digest", d);
+        pt::write_json(meta.string(), m);
+        return d;
+    }
+
+private:
+    bool revalidate()
+    {
+
+        fs::create_directories(json.parent_path());
+
+        ptree m;
+        bool cached = fs::exists(json) && fs::exists(meta);
+        if (cached)
+        {
+            try
+            {
+                pt::read_json(meta.string(), m);
+            }
+            catch (std::exception &)
+            {
+                cached = false;
+            }
+        }
+
+        http_response r;
+        try
+        {
+            r = download_string_if_modified(url,
+                cached ? m.get("etag", "") : "",
+                cached ? m.get("last_modified", "") : "");
+        }
+        catch (cancelled_error &)
+        {
+            throw;
+        }
+        catch (std::exception &e)
+        {
+            // a body without readable meta is still good for offline use
+            if (!fs::exists(json))
+                throw;
+            LOG_WARN(logger, "Cannot revalidate manifest " << url << ": " << e.what()
+                << ". Using the cached copy " << json << ", it may be out of date");
+            return false;
+        }
+
+        if (r.http_code == 304 && cached)
+        {
+            LOG_DEBUG(logger, "Manifest " << url << " is not changed");
+            return false;
+        }
+
+        std::error_code ec;
+        fs::remove(bin, ec);
+        fs::remove(repo, ec);
+        write_file(json, r.body);
+        m.clear();
+        m.put("url", url);
+        m.put("etag", r.etag);
+        m.put("last_modified", r.last_modified);
+        m.put("digest", body_digest(r.body));
+        pt::write_json(meta.string(), m);
+        return true;
+    }
+
+public:
+    ptree load() const
+    {
+        ptree p;
+        if (read_binary_ptree(bin, p))
+            return p;
+        p = parse_manifest(read_file(json), url);
+        // a plan does not write anything
+        if (settings.mode != run_mode::plan)
+            write_binary_ptree(p, bin);
+        return p;
+    }
+
+    repository load_repository() const
+    {
+        repository r;
+        if (r.load_binary(repo))
+            return r;
+        r.parse(read_file(json), url);
+        if (settings.mode != run_mode::plan)
+            r.save_binary(repo);
+        return r;
+    }
+};
+
+// Pull parser over a json buffer, values are consumed without building a tree.
+class json_reader
+{
+public:
+    json_reader(const String &s, const String &name)
+        : begin(s.data()), p(s.data()), end(s.data() + s.size()), name(name)
+    {
+    }
+
+    // calls f(key) for every key, f must consume the value
+    template <class F>
+    void object(F &&f)
+    {
+        expect('{');
+        if (next() == '}')
+        {
+            p++;
+            return;
+        }
+        while (1)
+        {
+            String scratch;
+            auto key = string(scratch);
+            expect(':');
+            f(key);
+            if (next() == ',')
+            {
+                p++;
+                continue;
+            }
+            expect('}');
+            return;
+        }
+    }
+
+    // calls f() for every element, f must consume it
+    template <class F>
+    void array(F &&f)
+    {
+        expect('[');
+        if (next() == ']')
+        {
+            p++;
+            return;
+        }
+        while (1)
+        {
+            f();
+            if (next() == ',')
+            {
+                p++;
+                continue;
+            }
+            expect(']');
+            return;
+        }
+    }
+
+    // view into the buffer, or into scratch if the string has escapes
+    std::string_view string(String &scratch)
+    {
+        expect('"');
+        auto s = p;
+        while (p < end && *p != '"' && *p != '\\')
+            p++;
+        if (p < end && *p == '"')
+            return std::string_view(s, p++ - s);
+
+        scratch.assign(s, p);
+        while (1)
+        {
+            if (p >= end)
+                error("unterminated string");
+            char c = *p++;
+            if (c == '"')
+                return scratch;
+            if (c != '\\')
+            {
+                scratch += c;
+                continue;
+            }
+            if (p >= end)
+                error("unterminated string");
+            switch (c = *p++)
+            {
+            case 'b': scratch += '\b'; break;
+            case 'f': scratch += '\f'; break;
+            case 'n': scratch += '\n'; break;
+            case 'r': scratch += '\r'; break;
+            case 't': scratch += '\t'; break;
+            case 'u': unicode(scratch); break;
+            default: scratch += c; break;
+            }
+        }
+    }
+
+    int64_t integer()
+    {
+        // ptree took quoted numbers as well: "size": "123"
+        if (next() == '"')
+        {
+            String scratch;
+            auto s = string(scratch);
+            auto q = s.data();
+            auto v = number(q, s.data() + s.size());
+            if (q != s.data() + s.size())
+                error("number expected");
+            return v;
+        }
+        return number(p, end);
+    }
+
+    int32_t int32()
+    {
+        auto v = integer();
+        if (v < std::numeric_limits<int32_t>::min() || v > std::numeric_limits<int32_t>::max())
+            error("number is out of range");
+        return (int32_t)v;
+    }
+
+    bool boolean()
+    {
+        auto c = next();
+        if (c == '"')
+        {
+            String scratch;
+            return string(scratch) == "true";
+        }
+        if (literal("true"))
+            return true;
+        if (literal("false") || literal("null"))
+            return false;
+        error("boolean expected");
+        return false;
+    }
+
+    // string or number as text
+    std::string_view scalar(String &scratch)
+    {
+        auto c = next();
+        if (c == '"')
+            return string(scratch);
+        auto s = p;
+        skip();
+        return std::string_view(s, p - s);
+    }
+
+    void skip()
+    {
+        switch (next())
+        {
+        case '{':
+            object([this](auto) { skip(); });
+            break;
+        case '[':
+            array([this] { skip(); });
+            break;
+        case '"':
+        {
+            String scratch;
+            string(scratch);
+            break;
+        }
+        default:
+            if (literal("true") || literal("false") || literal("null"))
+                break;
+            integer();
+            break;
+        }
+    }
+
+    void finish()
+    {
+        if (next() != 0)
+            error("trailing data");
+    }
+
+private:
+    const char *begin;
+    const char *p;
+    const char *end;
+    const String &name;
+
+    // reads a number at q, moves q past it
+    int64_t number(const char *&q, const char *e)
+    {
+        bool neg = q < e && *q == '-';
+        if (neg)
+            q++;
+        if (q >= e || !isdigit((unsigned char)*q))
+            error("number expected");
+        int64_t v = 0;
+        while (q < e && isdigit((unsigned char)*q))
+        {
+            int d = *q++ - '0';
+            if (v > (std::numeric_limits<int64_t>::max() - d) / 10)
+                error("number is too large");
+            v = v * 10 + d;
+        }
+        // fractions and exponents are not used in manifests, drop them
+        while (q < e && (*q == '.' || *q == 'e' || *q == 'E' || *q == '+' || *q == '-' || isdigit((unsigned char)*q)))
+            q++;
+        return neg ? -v : v;
+    }
+
+    char next()
+    {
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+        return p < end ? *p : 0;
+    }
+
+    void expect(char c)
+    {
+        if (next() != c)
+            error(String("'") + c + "' expected");
+        p++;
+    }
+
+    bool literal(const char *s)
+    {
+        auto n = strlen(s);
+        if ((size_t)(end - p) < n || memcmp(p, s, n) != 0)
+            return false;
+        p += n;
+        return true;
+    }
+
+    uint32_t hex4()
+    {
+        if (end - p < 4)
+            error("bad escape");
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            char c = *p++;
+            v <<= 4;
+            if (c >= '0' && c <= '9')
+                v |= c - '0';
+            else if (c >= 'a' && c <= 'f')
+                v |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F')
+                v |= c - 'A' + 10;
+            else
+                error("bad escape");
+        }
+        return v;
+    }
+
+    void unicode(String &out)
+    {
+        auto cp = hex4();
+        if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+        {
+            p += 2;
+            auto lo = hex4();
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        }
+        if (cp < 0x80)
+            out += (char)cp;
+        else if (cp < 0x800)
+        {
+            out += (char)(0xC0 | cp >> 6);
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += (char)(0xE0 | cp >> 12);
+            out += (char)(0x80 | (cp >> 6 & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += (char)(0xF0 | cp >> 18);
+            out += (char)(0x80 | (cp >> 12 & 0x3F));
+            out += (char)(0x80 | (cp >> 6 & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+
+    [[noreturn]] void error(const String &msg)
+    {
+        LOG_ERROR(logger, "Json file: " << name << " has errors in its structure!");
+        LOG_ERROR(logger, msg << " at offset " << (p - begin));
+        LOG_ERROR(logger, "Please, report to the author.");
+        throw SW_RUNTIME_ERROR("Bad json: " + name);
+    }
+};
+
+void write_string(std::ostream &o, const String &s)
+{
+    uint32_t n = (uint32_t)s.size();
+    o.write((const char *)&n, sizeof(n));
+    o.write(s.data(), s.size());
+}
+
+void write_node(std::ostream &o, const ptree &p)
+{
+    write_string(o, p.data());
+    uint32_t n = (uint32_t)p.size();
+    o.write((const char *)&n, sizeof(n));
+    for (auto &c : p)
+    {
+        write_string(o, c.first);
+        write_node(o, c.second);
+    }
+}
+
+struct reader
+{
+    const char *p;
+    const char *end;
+
+    bool read(uint32_t &n)
+    {
+        if (end - p < (ptrdiff_t)sizeof(n))
+            return false;
+        memcpy(&n, p, sizeof(n));
+        p += sizeof(n);
+        return true;
+    }
+
+    bool read(String &s)
+    {
+        uint32_t n;
+        if (!read(n) || end - p < n)
+            return false;
+        s.assign(p, n);
+        p += n;
+        return true;
+    }
+
+    bool read(ptree &t)
+    {
+        uint32_t n;
+        if (!read(t.data()) || !read(n))
+            return false;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            String key;
+            if (!read(key))
+                return false;
+            auto &c = t.push_back({ key, ptree() })->second;
+            if (!read(c))
+                return false;
+        }
+        return true;
+    }
+};
+
+}
+
+ptree parse_manifest(const String &s, const String &name)
+{
+    ptree pt;
+    std::stringstream ss(s);
+    try
+    {
+        pt::json_parser::read_json(ss, pt);
+    }
+    catch (pt::json_parser_error &e)
+    {
+        LOG_ERROR(logger, "Json file: " << name << " has errors in its structure!");
+        LOG_ERROR(logger, e.what());
+        LOG_ERROR(logger, "Please, report to the author.");
+        throw;
+    }
+    return pt;
+}
+
+void write_binary_ptree(const ptree &p, const path &fn)
+{
+    auto tmp = fn;
+    tmp += ".tmp";
+    {
+        std::ofstream o(tmp, std::ios::binary | std::ios::trunc);
+        o.write(binary_header, sizeof(binary_header));
+        write_node(o, p);
+        if (!o)
+            throw SW_RUNTIME_ERROR("Cannot write " + tmp.string());
+    }
+    fs::rename(tmp, fn);
+}
+
+bool read_binary_ptree(const path &fn, ptree &p)
+{
+    if (!fs::exists(fn))
+        return false;
+    auto s = read_file(fn);
+    if (s.size() < sizeof(binary_header) || memcmp(s.data(), binary_header, sizeof(binary_header)) != 0)
+        return false;
+    reader r{ s.data() + sizeof(binary_header), s.data() + s.size() };
+    p.clear();
+    return r.read(p) && r.p == r.end;
+}
+
+ptree load_manifest(const String &url)
+{
+    cache_entry c(url);
+    c.fetch();
+    return c.load();
+}
+
+repository load_repository(const String &url)
+{
+    cache_entry c(url);
+    c.fetch();
+    return c.load_repository();
+}
+
+String manifest_digest(const String &url)
+{
+    cache_entry c(url);
+    c.fetch();
+    return c.digest();
+}
+
+repository::repository()
+{
+    // id 0 is the empty string
+    intern({});
+}
+
+std::string_view repository::str(string_id id) const
+{
+    auto &r = refs[id];
+    return std::string_view(strings.data() + r.offset, r.size);
+}
+
+String repository::md5(const file &f) const
+{
+    return f.has_md5 ? to_hex(f.md5.data(), f.md5.size()) : String();
+}
+
+repository::string_id repository::intern(std::string_view s)
+{
+    auto h = std::hash<std::string_view>()(s);
+    auto range = interned.equal_range(h);
+    for (auto i = range.first; i != range.second; ++i)
+    {
+        if (str(i->second) == s)
+            return i->second;
+    }
+    string_id id = (string_id)refs.size();
+    refs.push_back({ (uint32_t)strings.size(), (uint32_t)s.size() });
+    strings.append(s);
+    interned.emplace(h, id);
+    return id;
+}
+
+void repository::set_md5(file &f, std::string_view hex)
+{
+    String bin;
+    f.has_md5 = from_hex(String(hex), bin) && bin.size() == f.md5.size();
+    if (f.has_md5)
+        memcpy(f.md5.data(), bin.data(), bin.size());
+    else if (!hex.empty())
+        throw SW_RUNTIME_ERROR("Bad md5 in manifest: " + String(hex));
+}
+
+String repository::digest(const file &f) const
+{
+    if (f.hash)
+        return String(str(f.hash));
+    return md5(f);
+}
+
+void repository::set_hash(file &f, std::string_view digest)
+{
+    if (digest.empty())
+        return;
+    hash_algorithm a;
+    String hex, bin;
+    if (!parse_digest(String(digest), a, hex) || !from_hex(hex, bin) || bin.empty())
+    {
+        // newer algorithm than we know, md5 is still there for us
+        LOG_DEBUG(logger, "Ignoring hash " << digest);
+        return;
+    }
+    f.hash = intern(make_digest(a, to_hex((const uint8_t *)bin.data(), bin.size())));
+}
+
+void repository::load(const ptree &p)
+{
+    redirect = p.get("redirect", "");
+    file_prefix = p.get("file_prefix", "");
+    jobs = p.get<int>("jobs", 0);
+    connections_per_host = p.get<int>("connections_per_host", 0);
+    if (!redirect.empty())
+        return;
+    for (auto &pf : p.get_child("files"))
+    {
+        file f;
+        f.url = intern(pf.second.get<String>("url"));
+        f.name = intern(pf.second.get<String>("name", ""));
+        f.check_path = intern(pf.second.get<String>("check_path", ""));
+        f.signature = intern(pf.second.get<String>("signature", ""));
+        set_md5(f, pf.second.get<String>("md5", ""));
+        set_hash(f, pf.second.get<String>("hash", ""));
+        f.size = pf.second.get<int64_t>("size", 0);
+        f.priority = pf.second.get<int32_t>("priority", 0);
+        f.packed = pf.second.get<bool>("packed", false);
+        files.push_back(f);
+    }
+}
+
+void repository::parse(const String &json, const String &name)
+{
+    json_reader r(json, name);
+    String scratch;
+    r.object([&](std::string_view key)
+    {
+        if (key == "redirect")
+            redirect = r.string(scratch);
+        else if (key == "file_prefix")
+            file_prefix = r.string(scratch);
+        else if (key == "jobs")
+            jobs = r.int32();
+        else if (key == "connections_per_host")
+            connections_per_host = r.int32();
+        else if (key == "files")
+        {
+            r.array([&]()
+            {
+                file f;
+                bool has_url = false;
+                r.object([&](std::string_view key)
+                {
+                    if (key == "url")
+                    {
+                        f.url = intern(r.scalar(scratch));
+                        has_url = true;
+                    }
+                    else if (key == "name")
+                        f.name = intern(r.scalar(scratch));
+                    else if (key == "check_path")
+                        f.check_path = intern(r.scalar(scratch));
+                    else if (key == "signature")
+                        f.signature = intern(r.scalar(scratch));
+                    else if (key == "md5")
+                        set_md5(f, r.scalar(scratch));
+                    else if (key == "hash")
+                        set_hash(f, r.scalar(scratch));
+                    else if (key == "size")
+                        f.size = r.integer();
+                    else if (key == "priority")
+                        f.priority = r.int32();
+                    else if (key == "packed")
+                        f.packed = r.boolean();
+                    else
+                        r.skip();
+                });
+                if (!has_url)
+                    throw SW_RUNTIME_ERROR("No url for a file in " + name);
+                files.push_back(f);
+            });
+        }
+        else
+            r.skip();
+    });
+    r.finish();
+    interned.clear();
+}
+
+void repository::save_binary(const path &fn) const
+{
+    auto tmp = fn;
+    tmp += ".tmp";
+    {
+        std::ofstream o(tmp, std::ios::binary | std::ios::trunc);
+        auto put = [&o](const auto &v)
+        {
+            o.write((const char *)&v, sizeof(v));
+        };
+        auto put_string = [&o, &put](const String &s)
+        {
+            put((uint64_t)s.size());
+            o.write(s.data(), s.size());
+        };
+        // fields are written one by one, no padding or struct layout gets in
+        o.write(repository_header, sizeof(repository_header));
+        put(file_record_size);
+        put_string(redirect);
+        put_string(file_prefix);
+        put((int32_t)jobs);
+        put((int32_t)connections_per_host);
+        put_string(strings);
+        put((uint64_t)refs.size());
+        for (auto &r : refs)
+        {
+            put(r.offset);
+            put(r.size);
+        }
+        put((uint64_t)files.size());
+        for (auto &f : files)
+        {
+            for (auto id : { f.name, f.url, f.check_path, f.signature, f.hash })
+                put(id);
+            put(f.md5);
+            put(f.size);
+            put(f.priority);
+            put(uint8_t((f.has_md5 ? file_has_md5 : 0) | (f.packed ? file_packed : 0)));
+        }
+        if (!o)
+            throw SW_RUNTIME_ERROR("Cannot write " + tmp.string());
+    }
+    fs::rename(tmp, fn);
+}
+
+bool repository::load_binary(const path &fn)
+{
+    if (!fs::exists(fn))
+        return false;
+    auto s = read_file(fn);
+    if (s.size() < sizeof(repository_header) || memcmp(s.data(), repository_header, sizeof(repository_header)) != 0)
+        return false;
+
+    auto p = s.data() + sizeof(repository_header);
+    auto end = s.data() + s.size();
+    auto get = [&p, end](auto &v)
+    {
+        if (end - p < (ptrdiff_t)sizeof(v))
+            return false;
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return true;
+    };
+    // number of elements of elem bytes that must follow
+    auto get_count = [&p, end, &get](uint64_t &n, size_t elem)
+    {
+        return get(n) && n <= (uint64_t)(end - p) / elem;
+    };
+    auto get_string = [&p, &get_count](String &v)
+    {
+        uint64_t n;
+        if (!get_count(n, 1))
+            return false;
+        v.assign(p, n);
+        p += n;
+        return true;
+    };
+
+    // a damaged file leaves this one as it was
+    repository r;
+    uint32_t record_size;
+    int32_t jobs32, connections32;
+    if (!get(record_size) || record_size != file_record_size ||
+        !get_string(r.redirect) || !get_string(r.file_prefix) || !get(jobs32) || !get(connections32) ||
+        !get_string(r.strings))
+        return false;
+    r.jobs = jobs32;
+    r.connections_per_host = connections32;
+
+    uint64_t n;
+    if (!get_count(n, 2 * sizeof(uint32_t)))
+        return false;
+    r.refs.resize(n);
+    for (auto &ref : r.refs)
+    {
+        if (!get(ref.offset) || !get(ref.size) || (uint64_t)ref.offset + ref.size > r.strings.size())
+            return false;
+    }
+
+    if (!get_count(n, file_record_size))
+        return false;
+    r.files.resize(n);
+    for (auto &f : r.files)
+    {
+        uint8_t flags;
+        if (!get(f.name) || !get(f.url) || !get(f.check_path) || !get(f.signature) || !get(f.hash) ||
+            !get(f.md5) || !get(f.size) || !get(f.priority) || !get(flags))
+            return false;
+        if (flags & ~(file_has_md5 | file_packed))
+            return false;
+        f.has_md5 = flags & file_has_md5;
+        f.packed = flags & file_packed;
+        // ids must point into the tables
+        for (auto id : { f.name, f.url, f.check_path, f.signature, f.hash })
+        {
+            if (id >= r.refs.size())
+                return false;
+        }
+    }
+    if (p != end)
+        return false;
+
+    r.interned.clear();
+    *this = std::move(r);
+    return true;
+}
@@ -0,0 +1,116 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "functional.h"
+
+#include <array>
+#include <string_view>
+#include <unordered_map>
+
+// BootstrapDownloads/manifests/<md5 of url>.{json,bin,repo,meta}
+#define MANIFEST_CACHE "manifests"
+
+//
+// types
+//
+
+// Files list of a release/developer/tools manifest in compact form.
+// All strings are interned into one buffer, entries refer to them by id.
+struct repository
+{
+    using string_id = uint32_t;
+
+    struct file
+    {
+        string_id name = 0;
+        string_id url = 0;
+        string_id check_path = 0;
+        string_id signature = 0;
+        // "<algorithm>:<hex>", preferred over md5 when the algorithm is known
+        string_id hash = 0;
+        std::array<uint8_t, 16> md5{};
+        int64_t size = 0;
+        // entries of higher priority are downloaded first
+        int32_t priority = 0;
+        bool has_md5 = false;
+        bool packed = false;
+    };
+
+    String redirect;
+    String file_prefix;
+    int jobs = 0;
+    int connections_per_host = 0;
+    std::vector<file> files;
+
+    repository();
+
+    std::string_view str(string_id id) const;
+    String md5(const file &f) const;
+    // digest the file is checked with: hash if present, md5 otherwise
+    String digest(const file &f) const;
+
+    // from a manifest already loaded as ptree
+    void load(const ptree &p);
+    // streaming parse of manifest json
+    void parse(const String &json, const String &name);
+
+    void save_binary(const path &fn) const;
+    // returns false if the file is missing or damaged
+    bool load_binary(const path &fn);
+
+private:
+    struct string_ref
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    String strings;
+    std::vector<string_ref> refs;
+    std::unordered_multimap<size_t, string_id> interned;
+
+    string_id intern(std::string_view s);
+    void set_md5(file &f, std::string_view hex);
+    void set_hash(file &f, std::string_view digest);
+};
+
+//
+// function declarations
+//
+
+// Returns manifest from url. A cached copy is revalidated with a conditional
+// GET (ETag/Last-Modified); when it has not changed, the pre-parsed binary
+// form is loaded and no body is downloaded or parsed.
+// If the server cannot be reached, the cached copy is used.
+// A --plan run uses the cached copy without any request.
+ptree load_manifest(const String &url);
+
+// Same as load_manifest(), parsed straight into the typed form.
+repository load_repository(const String &url);
+
+// md5 of the manifest body, revalidated the same way.
+// Every url is revalidated once per run whichever of these is called.
+String manifest_digest(const String &url);
+
+ptree parse_manifest(const String &s, const String &name);
+
+void write_binary_ptree(const ptree &p, const path &fn);
+// returns false if the file is missing or damaged
+bool read_binary_ptree(const path &fn, ptree &p);
@@ -0,0 +1,221 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "plan.h"
+
+#include "digest.h"
+#include "log_sink.h"
+#include "lwt.h"
+#include "store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <unordered_set>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "plan");
+
+static std::atomic<int64_t> total_bytes{ 0 };
+
+// mirrors the decisions of a normal run
+enum class plan_action
+{
+    up_to_date,
+    // changed by the user, kept as is
+    modified,
+    // not in the catalog yet, hashed and kept
+    hash,
+    download,
+    // created from a verified blob of the content store
+    store,
+    // untouched older version, by a delta when the entry has a signature
+    update,
+    // archive is downloaded and extracted
+    unpack,
+    // archive left on disk is extracted again
+    extract,
+    // archive left on disk is hashed, downloaded if it does not match
+    check,
+
+    count,
+};
+
+static const char *action_names[] =
+{
+    "up to date",
+    "modified",
+    "hash",
+    "download",
+    "store",
+    "update",
+    "unpack",
+    "extract",
+    "check",
+};
+static_assert(std::size(action_names) == (size_t)plan_action::count);
+
+// write time of the file, 0 if it does not exist;
+// one stat() per call, it is all a plan costs per entry
+static fs::file_time_type::rep stat_lwt(const path &p)
+{
+    std::error_code ec;
+    auto t = fs::last_write_time(p, ec);
+    return ec ? 0 : t.time_since_epoch().count();
+}
+
+static plan_action plan_file(const repository &data, const repository::file &f, const path &dir,
+    const path &output_dir, const local_lwt &lwt)
+{
+    auto new_hash = data.digest(f);
+    String check_path(data.str(f.check_path));
+    if (!check_path.empty() && check_path[0] == '/')
+        check_path = check_path.substr(1);
+
+    if (f.packed)
+    {
+        auto archive = dir / (data.file_prefix + String(data.str(f.name)));
+        auto e = lwt.find(archive);
+        bool extracted = e && (e->hash == new_hash || (f.has_md5 && e->hash == data.md5(f)));
+        if (extracted && (check_path.empty() || stat_lwt(output_dir / check_path)))
+            return plan_action::up_to_date;
+        auto archive_lwt = stat_lwt(archive);
+        if (!archive_lwt)
+            return plan_action::unpack;
+        // digest of the archive may be cached under its write time
+        if (e && e->lwt == archive_lwt && e->hash == new_hash)
+            return plan_action::extract;
+        return plan_action::check;
+    }
+
+    auto file = output_dir / check_path;
+    auto file_lwt = stat_lwt(file);
+    if (!file_lwt)
+    {
+        if (new_hash.empty())
+            return plan_action::download;
+        auto blob = store_blob_path(dir, new_hash);
+        auto b = lwt.find(blob);
+        auto blob_lwt = b ? stat_lwt(blob) : 0;
+        if (blob_lwt && b->hash == new_hash && b->lwt == blob_lwt)
+            return plan_action::store;
+        return plan_action::download;
+    }
+
+    auto e = lwt.find(file);
+    if (!e)
+        return plan_action::hash;
+    if (e->lwt == 0 || e->lwt != file_lwt)
+        return e->hash == new_hash ? plan_action::up_to_date : plan_action::modified;
+
+    // catalog keeps md5 from before the manifest got a new hash
+    auto expected = new_hash;
+    if (f.has_md5 && !e->hash.empty() && digest_algorithm(e->hash) == hash_algorithm::md5)
+        expected = data.md5(f);
+    if (e->hash == expected)
+        return plan_action::up_to_date;
+    if (e->hash.empty() || digest_algorithm(e->hash) != digest_algorithm(expected))
+        return plan_action::hash;
+    return plan_action::update;
+}
+
+void plan_files(const path &dir, const path &output_dir, const repository &data)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    local_lwt lwt;
+    lwt.open_read_only(path(BOOTSTRAP_DOWNLOADS) / LAST_WRITE_TIME_JOURNAL);
+
+    // stat() dominates, run it on several threads
+    std::vector<plan_action> actions(data.files.size(), plan_action::up_to_date);
+    std::atomic_size_t next{ 0 };
+    size_t n_threads = settings.jobs ? settings.jobs : std::thread::hardware_concurrency();
+    n_threads = std::clamp<size_t>(n_threads, 1, std::max<size_t>(data.files.size() / 1024, 1));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            const size_t batch = 256;
+            size_t b;
+            while ((b = next.fetch_add(batch)) < actions.size())
+            {
+                for (auto i = b; i < std::min(b + batch, actions.size()); i++)
+                    actions[i] = plan_file(data, data.files[i], dir, output_dir, lwt);
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    int64_t counts[(size_t)plan_action::count]{};
+    int64_t sizes[(size_t)plan_action::count]{};
+    // a big tree gives thousands of entries, the first ones of each action are listed
+    std::deque<progress_log> listed;
+    for (auto name : action_names)
+        listed.emplace_back(name);
+    // entries with the same digest download one blob
+    std::unordered_set<String> fetched;
+    for (size_t i = 0; i < data.files.size(); i++)
+    {
+        auto &f = data.files[i];
+        auto a = actions[i];
+        if (a == plan_action::download && !f.packed && !data.digest(f).empty() && !fetched.insert(data.digest(f)).second)
+            a = plan_action::store;
+        counts[(size_t)a]++;
+        if (a == plan_action::download || a == plan_action::update || a == plan_action::unpack || a == plan_action::check)
+            sizes[(size_t)a] += f.size;
+        if (a == plan_action::up_to_date)
+            continue;
+
+        String name(f.packed ? data.str(f.name) : data.str(f.check_path));
+        listed[(size_t)a].add(name + " (" + std::to_string(f.size) + " bytes)");
+    }
+    for (auto &l : listed)
+        l.finish();
+    flush_log();
+
+    int64_t bytes = 0;
+    for (auto a : { plan_action::download, plan_action::update, plan_action::unpack })
+        bytes += sizes[(size_t)a];
+    total_bytes += bytes;
+
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO(logger, "Plan for " << output_dir << ": " << data.files.size() << " file(s), "
+        << bytes << " bytes (" << bytes / 1024 / 1024 << " MB) to download, made in " << seconds << " s");
+    for (size_t a = 0; a < (size_t)plan_action::count; a++)
+    {
+        if (!counts[a])
+            continue;
+        if (sizes[a])
+            LOG_INFO(logger, "    " << action_names[a] << ": " << counts[a] << " (" << sizes[a] << " bytes)");
+        else
+            LOG_INFO(logger, "    " << action_names[a] << ": " << counts[a]);
+    }
+    if (counts[(size_t)plan_action::check])
+        LOG_INFO(logger, "Up to " << sizes[(size_t)plan_action::check] << " bytes more if archives left on disk do not match");
+    if (counts[(size_t)plan_action::update])
+        LOG_INFO(logger, "Updates with a block signature may download less");
+}
+
+int64_t planned_bytes()
+{
+    return total_bytes;
+}
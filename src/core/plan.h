@@ -0,0 +1,37 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "manifest.h"
+
+#include <stdint.h>
+
+//
+// function declarations
+//
+
+// Logs what a normal run would do with every entry of data and how many
+// bytes it would download. Works from the lwt catalog and stat() only:
+// nothing is transferred, hashed or written.
+// Archives left on disk by an older bootstrapper are hashed by a real run,
+// bytes they may need are reported apart.
+void plan_files(const path &dir, const path &output_dir, const repository &data);
+
+// bytes to download found by all plan_files() calls of the process
+int64_t planned_bytes();
@@ -17,6 +17,10 @@
  */
 
 #include "functional.h"
+#include "plan.h"
+#include "throttle.h"
+#include "trace.h"
+#include "verify.h"
 
 #include <primitives/sw/main.h>
 
@@ -27,6 +31,52 @@ DECLARE_STATIC_LOGGER(logger, "main");
 
 std::thread::id main_thread_id;
 
+// written on failures too, they show where a bad run spent its time
+static void write_traces()
+{
+    try
+    {
+        if (!settings.metrics_file.empty())
+            write_metrics(settings.metrics_file);
+        if (!settings.trace_file.empty())
+            write_chrome_trace(settings.trace_file);
+    }
+    catch (std::exception &e)
+    {
+        LOG_ERROR(logger, "Cannot write metrics: " << e.what());
+    }
+}
+
+// errors name the option, std::stoi() would only say "stoi"
+static int parse_count(const char *option, const String &v)
+{
+    size_t pos = 0;
+    int n = 0;
+    try
+    {
+        n = std::stoi(v, &pos);
+    }
+    catch (std::exception &)
+    {
+        pos = 0;
+    }
+    if (pos == 0 || pos != v.size() || n < 1)
+        throw SW_RUNTIME_ERROR(String("Bad value of ") + option + ": '" + v + "', expected a positive integer");
+    return n;
+}
+
+static int64_t parse_rate(const char *option, const String &v)
+{
+    try
+    {
+        return parse_rate(v);
+    }
+    catch (std::exception &)
+    {
+        throw SW_RUNTIME_ERROR(String("Bad value of ") + option + ": '" + v + "', expected a rate like 500K or 10M");
+    }
+}
+
 int main(int argc, char *argv[])
 {
     try
@@ -48,6 +98,14 @@ int main(int argc, char *argv[])
 
         main_thread_id = std::this_thread::get_id();
 
+        // local Bootstrap.json instead of the one from github
+        path bootstrap_json;
+        // limits adjustable while running
+        path throttle_file;
+
+        if (auto m = getenv(GIT_MIRRORS_ENV); m && *m)
+            settings.git_mirrors = m;
+
         // parse cmd
         if (argc > 1)
         {
@@ -69,6 +127,75 @@ int main(int argc, char *argv[])
                     print_version();
                     return 0;
                 }
+                else if ((strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0) && i + 1 < argc)
+                {
+                    settings.jobs = parse_count(arg, argv[++i]);
+                }
+                else if (strcmp(arg, "--connections-per-host") == 0 && i + 1 < argc)
+                {
+                    settings.connections_per_host = parse_count(arg, argv[++i]);
+                }
+                else if (strcmp(arg, "--hardlinks") == 0)
+                {
+                    settings.hardlinks = true;
+                }
+                else if (strcmp(arg, "--git-mirrors") == 0 && i + 1 < argc)
+                {
+                    settings.git_mirrors = argv[++i];
+                }
+                else if (strcmp(arg, "--bootstrap-json") == 0 && i + 1 < argc)
+                {
+                    bootstrap_json = argv[++i];
+                }
+                else if (strcmp(arg, "--metrics") == 0 && i + 1 < argc)
+                {
+                    settings.metrics_file = argv[++i];
+                    enable_file_records();
+                }
+                else if (strcmp(arg, "--trace") == 0 && i + 1 < argc)
+                {
+                    settings.trace_file = argv[++i];
+                    enable_chrome_trace();
+                }
+                else if (strcmp(arg, "--limit-rate") == 0 && i + 1 < argc)
+                {
+                    auto l = get_throttle_limits();
+                    l.rate = parse_rate(arg, argv[++i]);
+                    set_throttle_limits(l);
+                }
+                else if (strcmp(arg, "--limit-rate-per-host") == 0 && i + 1 < argc)
+                {
+                    auto l = get_throttle_limits();
+                    l.rate_per_host = parse_rate(arg, argv[++i]);
+                    set_throttle_limits(l);
+                }
+                else if (strcmp(arg, "--limit-disk-rate") == 0 && i + 1 < argc)
+                {
+                    auto l = get_throttle_limits();
+                    l.disk_rate = parse_rate(arg, argv[++i]);
+                    set_throttle_limits(l);
+                }
+                else if (strcmp(arg, "--throttle-file") == 0 && i + 1 < argc)
+                {
+                    throttle_file = argv[++i];
+                }
+                else if (strcmp(arg, "--verify") == 0)
+                {
+                    settings.mode = run_mode::verify;
+                }
+                else if (strcmp(arg, "--repair") == 0)
+                {
+                    settings.mode = run_mode::repair;
+                }
+                else if (strcmp(arg, "--repair-modified") == 0)
+                {
+                    settings.mode = run_mode::repair;
+                    settings.repair_modified = true;
+                }
+                else if (strcmp(arg, "--plan") == 0)
+                {
+                    settings.mode = run_mode::plan;
+                }
                 else
                 {
                     LOG_FATAL(logger, "Unknown option: " << arg);
@@ -79,18 +206,34 @@ int main(int argc, char *argv[])
 
         print_version();
 
-        auto data = load_data(String(BOOTSTRAP_JSON_URL));
+        // after all limits from the command line, they are the base for the file
+        if (!throttle_file.empty())
+            watch_throttle_file(throttle_file);
+
+        auto data = bootstrap_json.empty() ? load_data(String(BOOTSTRAP_JSON_URL)) : load_data(bootstrap_json);
 
         bootstrap_module_main(argc, argv, data);
+        write_traces();
+
+        if (settings.mode == run_mode::plan)
+            LOG_INFO(logger, "Total to download: " << planned_bytes() << " bytes (" << planned_bytes() / 1024 / 1024 << " MB)");
+
+        if (settings.mode == run_mode::verify && integrity_problems())
+        {
+            LOG_ERROR(logger, "Found " << integrity_problems() << " damaged file(s), run with --repair to fix them");
+            return 1;
+        }
     }
     catch (std::exception &e)
     {
         LOG_ERROR(logger, e.what());
+        write_traces();
         check_return_code(1);
     }
     catch (...)
     {
         LOG_FATAL(logger, "Unkown exception!");
+        write_traces();
         check_return_code(2);
     }
 
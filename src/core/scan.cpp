@@ -0,0 +1,241 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "functional.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+
+// Reads one directory without stat() calls where the OS already
+// tells us the entry type.
+void read_directory(const path &dir, std::vector<path> &dirs, std::vector<path> &files)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAW fd;
+    auto h = FindFirstFileExW((dir / L"*").wstring().c_str(), FindExInfoBasic, &fd,
+        FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        std::cerr << "Cannot read directory " << dir.string() << ": error " << GetLastError() << '\n';
+        return;
+    }
+    do
+    {
+        if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+            continue;
+        // do not follow junctions and directory symlinks
+        if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+            dirs.push_back(dir / fd.cFileName);
+        else
+            files.push_back(dir / fd.cFileName);
+    } while (FindNextFileW(h, &fd));
+    FindClose(h);
+#else
+    auto d = opendir(dir.c_str());
+    if (!d)
+    {
+        std::cerr << "Cannot read directory " << dir.string() << ": " << strerror(errno) << '\n';
+        return;
+    }
+    while (auto e = readdir(d))
+    {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+            continue;
+        auto type = e->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat((dir / e->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                type = DT_DIR;
+        }
+        // symlinks are not followed
+        if (type == DT_DIR)
+            dirs.push_back(dir / e->d_name);
+        else
+            files.push_back(dir / e->d_name);
+    }
+    closedir(d);
+#endif
+}
+
+// Each worker takes directories from the back of its own queue
+// and steals from the front of the others when it runs out of work.
+// Workers with nothing to steal sleep until a directory is queued.
+class directory_scanner
+{
+public:
+    directory_scanner(size_t n_threads)
+        : queues(n_threads), results(n_threads)
+    {
+    }
+
+    std::vector<path> scan(const path &root)
+    {
+        push(0, root);
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < queues.size(); i++)
+            threads.emplace_back([this, i] { run(i); });
+        for (auto &t : threads)
+            t.join();
+
+        size_t n = 0;
+        for (auto &r : results)
+            n += r.size();
+        std::vector<path> files;
+        files.reserve(n);
+        for (auto &r : results)
+            std::move(r.begin(), r.end(), std::back_inserter(files));
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+private:
+    struct queue
+    {
+        std::mutex m;
+        std::deque<path> dirs;
+    };
+
+    std::vector<queue> queues;
+    std::vector<std::vector<path>> results;
+    // queued directories plus those being read right now
+    std::atomic<size_t> pending{ 0 };
+    // directories in the queues
+    std::atomic<size_t> queued{ 0 };
+    std::mutex idle_m;
+    std::condition_variable idle;
+
+    void push(size_t i, path d)
+    {
+        pending++;
+        {
+            std::lock_guard<std::mutex> g(queues[i].m);
+            queues[i].dirs.push_back(std::move(d));
+        }
+        queued++;
+        wake(false);
+    }
+
+    void wake(bool all)
+    {
+        // a worker checks the counters under this lock before it sleeps
+        {
+            std::lock_guard<std::mutex> lk(idle_m);
+        }
+        if (all)
+            idle.notify_all();
+        else
+            idle.notify_one();
+    }
+
+    bool pop(size_t i, path &d)
+    {
+        {
+            auto &q = queues[i];
+            std::lock_guard<std::mutex> g(q.m);
+            if (!q.dirs.empty())
+            {
+                d = std::move(q.dirs.back());
+                q.dirs.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t j = 1; j < queues.size(); j++)
+        {
+            auto &q = queues[(i + j) % queues.size()];
+            std::lock_guard<std::mutex> g(q.m);
+            if (!q.dirs.empty())
+            {
+                d = std::move(q.dirs.front());
+                q.dirs.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t i)
+    {
+        std::vector<path> dirs;
+        path d;
+        while (1)
+        {
+            if (!pop(i, d))
+            {
+                std::unique_lock<std::mutex> lk(idle_m);
+                idle.wait(lk, [this] { return pending == 0 || queued > 0; });
+                if (pending == 0)
+                    return;
+                continue;
+            }
+            dirs.clear();
+            read_directory(d, dirs, results[i]);
+            for (auto &sd : dirs)
+                push(i, std::move(sd));
+            // the last directory is read, nobody will queue more
+            if (--pending == 0)
+                wake(true);
+        }
+    }
+};
+
+}
+
+std::vector<path> enumerate_files(const path &dir)
+{
+    try
+    {
+        if (!fs::exists(dir) || !fs::is_directory(dir))
+        {
+            std::cerr << "Source directory " << dir.string()
+                << " does not exist or is not a directory." << '\n';
+            return {};
+        }
+    }
+    catch (fs::filesystem_error const & e)
+    {
+        std::cerr << e.what() << '\n';
+        return {};
+    }
+
+    // normalize once, children are built by appending names
+    auto root = fs::absolute(dir).lexically_normal();
+    if (!root.has_filename())
+        root = root.parent_path();
+
+    size_t n_threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 32);
+    return directory_scanner(n_threads).scan(root);
+}
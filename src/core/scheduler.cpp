@@ -0,0 +1,267 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "scheduler.h"
+
+#include "download.h"
+#include "throttle.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <tuple>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "scheduler");
+
+// how often throughput is measured
+static const auto adapt_interval = std::chrono::seconds(2);
+// throughput change below this is treated as noise
+static const double adapt_threshold = 0.05;
+// backoff before the first retry, doubled for every next one
+static const auto retry_delay = std::chrono::seconds(1);
+static const auto max_retry_delay = std::chrono::seconds(30);
+
+static thread_local int task_attempt;
+
+// order in which tasks are started
+static bool goes_before(int priority1, int64_t size1, int priority2, int64_t size2)
+{
+    return std::tie(priority1, size1) > std::tie(priority2, size2);
+}
+
+String url_host(const String &url)
+{
+    auto p = url.find("://");
+    p = p == url.npos ? 0 : p + 3;
+    auto e = url.find_first_of("/?#", p);
+    return url.substr(p, e == url.npos ? e : e - p);
+}
+
+int current_task_attempt()
+{
+    return task_attempt;
+}
+
+download_scheduler::download_scheduler(int max_jobs, int max_per_host, int max_attempts)
+    : max_jobs(std::max(max_jobs, 1)), max_per_host(std::max(max_per_host, 1)), max_attempts(std::max(max_attempts, 1))
+{
+    limit = std::min(this->max_jobs, 4);
+}
+
+void download_scheduler::add(int64_t size, const String &url, std::function<void()> f, int priority)
+{
+    tasks.push_back({ size, url, url_host(url), std::move(f), priority });
+}
+
+std::vector<task_error> download_scheduler::run()
+{
+    // tasks are taken from the back: highest priority and largest first,
+    // equal ones in the order they were added
+    std::stable_sort(tasks.begin(), tasks.end(), [](const auto &a, const auto &b)
+    {
+        return goes_before(a.priority, a.size, b.priority, b.size);
+    });
+    std::reverse(tasks.begin(), tasks.end());
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < max_jobs; i++)
+        threads.emplace_back([this] { worker(); });
+    std::thread controller([this] { adapt(); });
+
+    for (auto &t : threads)
+        t.join();
+    {
+        std::lock_guard<std::mutex> lk(m);
+        stopped = true;
+    }
+    cv.notify_all();
+    controller.join();
+    return std::move(errors);
+}
+
+void download_scheduler::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if (!token.cancelled())
+            LOG_WARN(logger, "Cancelling " << tasks.size() << " queued and " << running << " running task(s)");
+        tasks.clear();
+        token.cancel();
+    }
+    cv.notify_all();
+}
+
+bool download_scheduler::pop(task &t, clock::time_point now, clock::time_point &next_due)
+{
+    if (running >= limit)
+        return false;
+    // biggest task whose host is not busy
+    for (auto i = tasks.rbegin(); i != tasks.rend(); ++i)
+    {
+        if (i->not_before > now)
+        {
+            next_due = std::min(next_due, i->not_before);
+            continue;
+        }
+        if (running_per_host[i->host] >= max_per_host)
+            continue;
+        t = std::move(*i);
+        tasks.erase(std::next(i).base());
+        return true;
+    }
+    return false;
+}
+
+// Puts a failed task back with exponential backoff and equal jitter:
+// half of the delay is fixed, the other half is random, so retries
+// of files from one host do not hit it at the same moment.
+void download_scheduler::retry(task t)
+{
+    static thread_local std::mt19937 rng(std::random_device{}());
+
+    auto delay = std::min<clock::duration>(retry_delay * (1 << std::min(t.attempt, 16)), max_retry_delay);
+    std::uniform_int_distribution<clock::rep> jitter(0, delay.count() / 2);
+    delay = delay / 2 + clock::duration(jitter(rng));
+    t.attempt++;
+    t.not_before = clock::now() + delay;
+    LOG_WARN(logger, "Retrying " << t.url << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(delay).count()
+        << " ms (attempt " << t.attempt + 1 << " of " << max_attempts << ")");
+
+    auto i = std::upper_bound(tasks.begin(), tasks.end(), t, [](const auto &a, const auto &b)
+    {
+        return goes_before(b.priority, b.size, a.priority, a.size);
+    });
+    tasks.insert(i, std::move(t));
+}
+
+void download_scheduler::worker()
+{
+    cancellation_scope cs(token);
+    while (1)
+    {
+        task t;
+        {
+            std::unique_lock<std::mutex> lk(m);
+            while (1)
+            {
+                // a running task may still fail and come back for a retry
+                if (tasks.empty() && running == 0)
+                    return;
+                auto next_due = clock::time_point::max();
+                if (pop(t, clock::now(), next_due))
+                    break;
+                if (next_due != clock::time_point::max())
+                    cv.wait_until(lk, next_due);
+                else
+                    cv.wait(lk);
+            }
+            running++;
+            running_per_host[t.host]++;
+        }
+
+        bool failed = false;
+        bool fatal = false;
+        String message;
+        try
+        {
+            io_priority_scope ps(t.priority);
+            task_attempt = t.attempt;
+            t.f();
+        }
+        catch (cancelled_error &)
+        {
+            // the error that caused it is reported by its own task
+        }
+        catch (fatal_error &e)
+        {
+            failed = fatal = true;
+            message = e.what();
+        }
+        catch (std::exception &e)
+        {
+            failed = true;
+            message = e.what();
+        }
+        catch (...)
+        {
+            failed = true;
+            message = "unknown error";
+        }
+
+        if (fatal)
+            cancel();
+
+        {
+            std::lock_guard<std::mutex> lk(m);
+            running--;
+            running_per_host[t.host]--;
+            if (failed && !fatal && !token.cancelled() && t.attempt + 1 < max_attempts)
+            {
+                LOG_ERROR(logger, message);
+                retry(std::move(t));
+            }
+            else if (failed)
+                errors.push_back({ t.url, message, t.attempt + 1, fatal });
+        }
+        cv.notify_all();
+    }
+}
+
+// Hill climbing on received bytes per second: keep moving the limit
+// in the same direction while throughput grows, turn back when it drops.
+void download_scheduler::adapt()
+{
+    auto last_bytes = downloaded_bytes();
+    double last_rate = 0;
+    int direction = 1;
+
+    std::unique_lock<std::mutex> lk(m);
+    while (!cv.wait_for(lk, adapt_interval, [this] { return stopped; }))
+    {
+        lk.unlock();
+        reload_throttle_file();
+        lk.lock();
+
+        auto bytes = downloaded_bytes();
+        double rate = double(bytes - last_bytes) / std::chrono::duration<double>(adapt_interval).count();
+        last_bytes = bytes;
+
+        // not enough work to saturate current limit, nothing to learn
+        if (running < limit && direction > 0)
+        {
+            last_rate = rate;
+            continue;
+        }
+
+        if (rate < last_rate * (1 - adapt_threshold))
+            direction = -direction;
+        else if (rate < last_rate * (1 + adapt_threshold) && direction < 0)
+            direction = 1;
+
+        auto new_limit = std::clamp(limit + direction * std::max(1, limit / 4), 1, max_jobs);
+        if (new_limit != limit)
+        {
+            LOG_DEBUG(logger, "Throughput " << int64_t(rate / 1024) << " KB/s, jobs: " << limit << " -> " << new_limit);
+            limit = new_limit;
+            cv.notify_all();
+        }
+        last_rate = rate;
+    }
+}
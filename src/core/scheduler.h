@@ -0,0 +1,117 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "cancel.h"
+
+//
+// types
+//
+
+// Task that has failed for good.
+struct task_error
+{
+    String url;
+    String message;
+    int attempts;
+    // fatal errors cancel the whole run
+    bool fatal;
+};
+
+// Runs download tasks on a pool of workers.
+//
+// Tasks of higher priority are started first, then largest ones,
+// so one big file does not end up as the tail of the run.
+// Priority also applies to bandwidth and disk limits of the task's io. Number of connections to one host is limited.
+// Number of concurrently running tasks starts low and is adjusted
+// by measured throughput between 1 and max_jobs.
+// A task that throws is run again on its own after an exponential
+// backoff with jitter, up to max_attempts times in total.
+// A task throwing fatal_error cancels the run: queued tasks are dropped,
+// running ones are aborted through the token current in their thread.
+class download_scheduler
+{
+public:
+    download_scheduler(int max_jobs, int max_per_host, int max_attempts = 3);
+
+    // size is used for ordering only, 0 if unknown
+    void add(int64_t size, const String &url, std::function<void()> f, int priority = 0);
+
+    // Runs all tasks and waits for them.
+    // Returns tasks that have failed all their attempts or a fatal error.
+    // Tasks interrupted by cancellation are not reported.
+    std::vector<task_error> run();
+
+    // can be called from any thread
+    void cancel();
+    bool cancelled() const { return token.cancelled(); }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct task
+    {
+        int64_t size;
+        String url;
+        String host;
+        std::function<void()> f;
+        int priority = 0;
+        int attempt = 0;
+        // retries wait for their backoff to pass
+        clock::time_point not_before;
+    };
+
+    int max_jobs;
+    int max_per_host;
+    int max_attempts;
+    // sorted by priority and size, taken from the back
+    std::vector<task> tasks;
+
+    std::mutex m;
+    std::condition_variable cv;
+    int limit = 1;
+    int running = 0;
+    std::map<String, int> running_per_host;
+    bool stopped = false;
+    cancellation_token token;
+    std::vector<task_error> errors;
+
+    bool pop(task &t, clock::time_point now, clock::time_point &next_due);
+    void retry(task t);
+    void worker();
+    void adapt();
+};
+
+//
+// function declarations
+//
+
+String url_host(const String &url);
+// attempt of the task running on this thread, 0 for the first one
+int current_task_attempt();
@@ -0,0 +1,250 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "store.h"
+
+#include "digest.h"
+#include "trace.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#include <winioctl.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <sstream>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "store");
+
+// blobs written this recently are not pruned
+static const auto prune_min_age = std::chrono::hours(24);
+
+static bool reflink_file(const path &from, const path &to)
+{
+#if defined(__linux__)
+    int src = ::open(from.c_str(), O_RDONLY);
+    if (src < 0)
+        return false;
+    int dst = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (dst < 0)
+    {
+        ::close(src);
+        return false;
+    }
+    bool ok = ioctl(dst, FICLONE, src) == 0;
+    ::close(src);
+    ::close(dst);
+    if (!ok)
+        ::unlink(to.c_str());
+    return ok;
+#elif defined(__APPLE__)
+    return clonefile(from.c_str(), to.c_str(), 0) == 0;
+#elif defined(_WIN32)
+    // ReFS block cloning, other file systems fail the ioctl
+    HANDLE src = CreateFileW(from.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (src == INVALID_HANDLE_VALUE)
+        return false;
+    HANDLE dst = CreateFileW(to.wstring().c_str(), GENERIC_READ | GENERIC_WRITE | DELETE, 0, nullptr, CREATE_NEW, 0, nullptr);
+    if (dst == INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(src);
+        return false;
+    }
+
+    DWORD bytes;
+    LARGE_INTEGER size;
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+    bool ok = GetFileSizeEx(src, &size) &&
+        DeviceIoControl(src, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &integrity, sizeof(integrity), &bytes, nullptr);
+    if (ok)
+    {
+        // the target must have its size before extents are cloned into it
+        FILE_END_OF_FILE_INFO eof;
+        eof.EndOfFile = size;
+        ok = SetFileInformationByHandle(dst, FileEndOfFileInfo, &eof, sizeof(eof));
+    }
+
+    // regions are whole clusters, the last one may go past the end of file;
+    // one call takes less than 4 GB
+    const int64_t cluster = integrity.ClusterSizeInBytes ? integrity.ClusterSizeInBytes : 4096;
+    const int64_t chunk = (1LL << 31) / cluster * cluster;
+    for (int64_t offset = 0; ok && offset < size.QuadPart; offset += chunk)
+    {
+        auto n = std::min(chunk, (size.QuadPart - offset + cluster - 1) / cluster * cluster);
+        DUPLICATE_EXTENTS_DATA d{};
+        d.FileHandle = src;
+        d.SourceFileOffset.QuadPart = offset;
+        d.TargetFileOffset.QuadPart = offset;
+        d.ByteCount.QuadPart = n;
+        ok = DeviceIoControl(dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &d, sizeof(d), nullptr, 0, &bytes, nullptr);
+    }
+
+    CloseHandle(src);
+    CloseHandle(dst);
+    if (!ok)
+        DeleteFileW(to.wstring().c_str());
+    return ok;
+#else
+    return false;
+#endif
+}
+
+path store_blob_path(const path &dir, const String &hash)
+{
+    hash_algorithm a;
+    String hex;
+    if (!parse_digest(hash, a, hex) || hex.size() < 2)
+        throw SW_RUNTIME_ERROR("Bad hash for store: " + hash);
+    // md5 blobs were there before other algorithms, they are kept in place;
+    // the others do not get ':' into file names (a stream name on NTFS)
+    auto root = dir / CONTENT_STORE;
+    if (a != hash_algorithm::md5)
+        root /= to_string(a);
+    return root / hex.substr(0, 2) / hex;
+}
+
+bool materialize_file(const path &blob, const path &file, bool allow_hardlink, bool consume_blob)
+{
+    trace_scope trace(trace_phase::store);
+    if (file.has_parent_path())
+        fs::create_directories(file.parent_path());
+
+    // build next to the target and move into place
+    auto tmp = file;
+    tmp += ".tmp";
+    std::error_code ec;
+    fs::remove(tmp, ec);
+
+    bool shared = true;
+    if (reflink_file(blob, tmp))
+    {
+        LOG_TRACE(logger, "reflinked " << file);
+    }
+    else if (allow_hardlink && (fs::create_hard_link(blob, tmp, ec), !ec))
+    {
+        LOG_TRACE(logger, "hardlinked " << file);
+    }
+    // a copy next to the blob would keep the same bytes twice
+    else if (consume_blob && (fs::rename(blob, file, ec), !ec))
+    {
+        LOG_TRACE(logger, "moved " << file);
+        return false;
+    }
+    else
+    {
+        fs::copy_file(blob, tmp, fs::copy_options::overwrite_existing);
+        LOG_TRACE(logger, "copied " << file);
+        if (consume_blob)
+            fs::remove(blob, ec);
+        shared = false;
+    }
+    fs::rename(tmp, file);
+    return shared;
+}
+
+bool set_store_references(const path &dir, const path &output_dir, const std::vector<String> &hashes)
+{
+    auto out = fs::absolute(output_dir).lexically_normal().u8string();
+    hash_stream md5;
+    md5.update(out.data(), out.size());
+    auto fn = dir / CONTENT_STORE / CONTENT_STORE_REFS / md5.digest();
+
+    auto sorted = hashes;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    // first line is the output dir
+    String s(out.begin(), out.end());
+    s += "\n";
+    for (auto &h : sorted)
+        s += h + "\n";
+
+    if (fs::exists(fn) && read_file(fn) == s)
+        return false;
+    fs::create_directories(fn.parent_path());
+    auto tmp = fn;
+    tmp += ".tmp";
+    write_file(tmp, s);
+    fs::rename(tmp, fn);
+    return true;
+}
+
+std::vector<path> prune_store(const path &dir)
+{
+    auto store = dir / CONTENT_STORE;
+    auto refs = store / CONTENT_STORE_REFS;
+    std::vector<path> removed;
+    if (!fs::exists(refs))
+        return removed;
+
+    std::set<path> used;
+    for (auto &e : fs::directory_iterator(refs))
+    {
+        if (e.path().extension() == ".tmp")
+            continue;
+        std::istringstream ss(read_file(e.path()));
+        String line;
+        std::getline(ss, line);
+        if (!fs::exists(path((const char8_t *)line.c_str())))
+        {
+            LOG_DEBUG(logger, "Dropping references of " << line);
+            std::error_code ec;
+            fs::remove(e.path(), ec);
+            continue;
+        }
+        while (std::getline(ss, line))
+        {
+            if (!line.empty())
+                used.insert(store_blob_path(dir, line).lexically_normal());
+        }
+    }
+
+    auto old = fs::file_time_type::clock::now() - prune_min_age;
+    int64_t bytes = 0;
+    for (auto i = fs::recursive_directory_iterator(store); i != fs::recursive_directory_iterator(); ++i)
+    {
+        if (i->path() == refs)
+        {
+            i.disable_recursion_pending();
+            continue;
+        }
+        std::error_code ec;
+        if (!i->is_regular_file(ec) || used.count(i->path().lexically_normal()))
+            continue;
+        if (i->last_write_time(ec) > old || ec)
+            continue;
+        auto size = i->file_size(ec);
+        if (fs::remove(i->path(), ec))
+        {
+            bytes += size;
+            removed.push_back(i->path());
+        }
+    }
+    if (!removed.empty())
+        LOG_INFO(logger, "Pruned " << removed.size() << " unused blob(s), " << bytes / 1024 / 1024 << " MB");
+    return removed;
+}
@@ -0,0 +1,54 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <vector>
+
+// content-addressed store of downloaded files inside BootstrapDownloads
+#define CONTENT_STORE "store"
+// dir/store/refs/<md5 of output dir>, blobs used by an install
+#define CONTENT_STORE_REFS "refs"
+
+//
+// function declarations
+//
+
+// md5: dir/store/ab/abcdef...
+// others: dir/store/<algorithm>/ab/abcdef...
+path store_blob_path(const path &dir, const String &hash);
+
+// Creates file with the contents of blob. Tries a reflink (copy-on-write
+// clone) first, then a hard link when allowed, then a plain copy.
+// A hard linked file shares its contents with the blob and every other
+// linked copy, an edit of one changes them all.
+// With consume_blob the blob is moved into place instead of copied, so its
+// bytes are not kept twice. Returns false if file shares nothing with blob
+// (it was copied or the blob was moved).
+bool materialize_file(const path &blob, const path &file, bool allow_hardlink = false, bool consume_blob = false);
+
+// Records digests of the blobs a sync into output_dir uses,
+// in dir/store/refs. Returns true if the list has changed.
+bool set_store_references(const path &dir, const path &output_dir, const std::vector<String> &hashes);
+
+// Removes blobs that no reference list has. Lists of output dirs that
+// do not exist anymore are dropped first. Recently written files are
+// kept, another process may be downloading them. Returns removed blobs.
+std::vector<path> prune_store(const path &dir);
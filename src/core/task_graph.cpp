@@ -0,0 +1,125 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "task_graph.h"
+
+#include "log_sink.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "stages");
+
+task_graph::stage_id task_graph::add(const String &name, std::function<void()> f, const std::vector<stage_id> &deps)
+{
+    for (auto d : deps)
+    {
+        if (d >= stages.size())
+            throw SW_RUNTIME_ERROR("Stage " + name + " depends on an unknown stage");
+    }
+    stages.push_back({ name, std::move(f), deps });
+    return stages.size() - 1;
+}
+
+void task_graph::run()
+{
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    size_t finished = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lk(m);
+    while (finished < stages.size())
+    {
+        // start everything that became ready, skip what can never be
+        bool changed;
+        do
+        {
+            changed = false;
+            for (auto &s : stages)
+            {
+                if (s.s != state::pending)
+                    continue;
+                bool ready = true, blocked = false;
+                for (auto d : s.deps)
+                {
+                    auto ds = stages[d].s;
+                    ready &= ds == state::done;
+                    blocked |= ds == state::failed || ds == state::skipped;
+                }
+                if (blocked)
+                {
+                    LOG_WARN(logger, "Skipping " << s.name << ", a stage it needs has failed");
+                    s.s = state::skipped;
+                    finished++;
+                    changed = true;
+                }
+                else if (ready)
+                {
+                    s.s = state::running;
+                    threads.emplace_back([&m, &cv, &error, &finished, &s]()
+                    {
+                        auto t = std::chrono::steady_clock::now();
+                        LOG_DEBUG(logger, "Starting " << s.name);
+                        std::exception_ptr e;
+                        try
+                        {
+                            log_source_scope source(s.name);
+                            s.f();
+                        }
+                        catch (...)
+                        {
+                            e = std::current_exception();
+                        }
+                        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+
+                        std::lock_guard<std::mutex> lk(m);
+                        if (e)
+                        {
+                            LOG_ERROR(logger, s.name << " failed after " << seconds << " s");
+                            if (!error)
+                                error = e;
+                        }
+                        else
+                            LOG_INFO(logger, s.name << " done in " << seconds << " s");
+                        s.s = e ? state::failed : state::done;
+                        finished++;
+                        cv.notify_all();
+                    });
+                }
+            }
+        } while (changed);
+
+        if (finished < stages.size())
+            cv.wait(lk);
+    }
+    lk.unlock();
+
+    for (auto &t : threads)
+        t.join();
+
+    LOG_INFO(logger, "All stages took " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s");
+    if (error)
+        std::rethrow_exception(error);
+}
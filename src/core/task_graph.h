@@ -0,0 +1,66 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <functional>
+#include <stdint.h>
+#include <vector>
+
+//
+// types
+//
+
+// Runs stages of a bootstrap on their own threads as soon as all stages
+// they depend on are done. Stages are coarse (a checkout, a download of
+// a package), so there is no pool: each one gets a thread when it starts.
+//
+// A stage that throws does not stop independent ones, stages that depend
+// on it are skipped. run() rethrows the first error after all of them end.
+class task_graph
+{
+public:
+    using stage_id = size_t;
+
+    // deps are ids returned by earlier calls, so there are no cycles
+    stage_id add(const String &name, std::function<void()> f, const std::vector<stage_id> &deps = {});
+
+    void run();
+
+private:
+    enum class state
+    {
+        pending,
+        running,
+        done,
+        failed,
+        skipped,
+    };
+
+    struct stage
+    {
+        String name;
+        std::function<void()> f;
+        std::vector<stage_id> deps;
+        state s = state::pending;
+    };
+
+    std::vector<stage> stages;
+};
@@ -0,0 +1,306 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "throttle.h"
+
+#include "cancel.h"
+#include "functional.h"
+
+#include <boost/property_tree/json_parser.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "throttle");
+
+// blocked consumers look at cancellation and rate changes this often
+static const auto max_wait = std::chrono::milliseconds(100);
+// consumers look at the control file this often
+static const auto poll_interval = std::chrono::seconds(1);
+
+namespace
+{
+
+struct throttle
+{
+    std::mutex m;
+    throttle_limits limits;
+    token_bucket network;
+    token_bucket disk;
+    std::unordered_map<String, std::unique_ptr<token_bucket>> hosts;
+
+    // control file
+    path fn;
+    throttle_limits base;
+    fs::file_time_type fn_time;
+    bool fn_exists = false;
+
+    static throttle &instance()
+    {
+        static throttle t;
+        return t;
+    }
+
+    token_bucket &host(const String &h)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto &b = hosts[h];
+        if (!b)
+            b = std::make_unique<token_bucket>(limits.rate_per_host);
+        return *b;
+    }
+
+    void set(const throttle_limits &l)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        limits = l;
+        network.set_rate(l.rate);
+        disk.set_rate(l.disk_rate);
+        for (auto &[_, b] : hosts)
+            b->set_rate(l.rate_per_host);
+    }
+};
+
+std::atomic_bool reload_requested;
+std::atomic<std::chrono::steady_clock::rep> next_poll{ 0 };
+thread_local int io_priority;
+
+#ifndef _WIN32
+void on_sighup(int)
+{
+    reload_requested = true;
+}
+#endif
+
+String format_rate(int64_t rate)
+{
+    return rate ? std::to_string(rate / 1024) + " KB/s" : "unlimited";
+}
+
+// Transfers outside of the scheduler pick up a changed control file
+// or SIGHUP here. One consumer per interval looks at the file.
+void poll_throttle_file()
+{
+    if (!reload_requested)
+    {
+        auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        auto due = next_poll.load();
+        if (now < due || !next_poll.compare_exchange_strong(due,
+            now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(poll_interval).count()))
+            return;
+    }
+    reload_throttle_file();
+}
+
+}
+
+token_bucket::token_bucket(int64_t rate)
+    : rate(rate), last(clock::now())
+{
+}
+
+void token_bucket::set_rate(int64_t r)
+{
+    {
+        std::lock_guard<std::mutex> lk(m);
+        refill(clock::now());
+        rate = std::max<int64_t>(r, 0);
+        tokens = std::min(tokens, (double)rate);
+    }
+    cv.notify_all();
+}
+
+int64_t token_bucket::get_rate() const
+{
+    std::lock_guard<std::mutex> lk(m);
+    return rate;
+}
+
+void token_bucket::refill(clock::time_point now)
+{
+    if (rate > 0)
+        tokens = std::min(tokens + rate * std::chrono::duration<double>(now - last).count(), (double)rate);
+    last = now;
+}
+
+void token_bucket::consume(int64_t n, int priority)
+{
+    poll_throttle_file();
+    std::unique_lock<std::mutex> lk(m);
+    if (rate <= 0)
+        return;
+
+    auto token = current_cancellation_token();
+    waiting[priority]++;
+    while (rate > 0)
+    {
+        refill(clock::now());
+        if (tokens >= 0 && waiting.rbegin()->first == priority)
+            break;
+        if (token && token->cancelled())
+            break;
+        auto d = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-tokens / rate));
+        cv.wait_for(lk, tokens < 0 ? std::min<clock::duration>(d, max_wait) : max_wait);
+        // a new rate is set on this bucket, it cannot be locked meanwhile
+        lk.unlock();
+        poll_throttle_file();
+        lk.lock();
+    }
+    if (--waiting[priority] == 0)
+        waiting.erase(priority);
+    if (rate > 0)
+        tokens -= n;
+    lk.unlock();
+    cv.notify_all();
+}
+
+io_priority_scope::io_priority_scope(int priority)
+    : previous(io_priority)
+{
+    io_priority = priority;
+}
+
+io_priority_scope::~io_priority_scope()
+{
+    io_priority = previous;
+}
+
+int current_io_priority()
+{
+    return io_priority;
+}
+
+throttle_limits get_throttle_limits()
+{
+    auto &t = throttle::instance();
+    std::lock_guard<std::mutex> lk(t.m);
+    return t.limits;
+}
+
+void set_throttle_limits(const throttle_limits &limits)
+{
+    throttle::instance().set(limits);
+}
+
+void watch_throttle_file(const path &fn)
+{
+    auto &t = throttle::instance();
+    {
+        std::lock_guard<std::mutex> lk(t.m);
+        t.fn = fn;
+        t.base = t.limits;
+    }
+#ifndef _WIN32
+    std::signal(SIGHUP, on_sighup);
+#endif
+    reload_requested = true;
+    reload_throttle_file();
+}
+
+void reload_throttle_file()
+{
+    auto &t = throttle::instance();
+    std::unique_lock<std::mutex> lk(t.m);
+    if (t.fn.empty())
+        return;
+
+    std::error_code ec;
+    auto exists = fs::exists(t.fn, ec);
+    auto time = exists ? fs::last_write_time(t.fn, ec) : fs::file_time_type();
+    if (!reload_requested.exchange(false) && exists == t.fn_exists && time == t.fn_time)
+        return;
+    t.fn_exists = exists;
+    t.fn_time = time;
+
+    auto l = t.base;
+    if (exists)
+    {
+        try
+        {
+            ptree p;
+            pt::read_json(t.fn.string(), p);
+            if (auto v = p.get_optional<String>("rate"))
+                l.rate = parse_rate(*v);
+            if (auto v = p.get_optional<String>("rate_per_host"))
+                l.rate_per_host = parse_rate(*v);
+            if (auto v = p.get_optional<String>("disk_rate"))
+                l.disk_rate = parse_rate(*v);
+        }
+        catch (std::exception &e)
+        {
+            // keep current limits until the file is fixed
+            LOG_WARN(logger, "Cannot read " << t.fn << ": " << e.what());
+            return;
+        }
+    }
+    lk.unlock();
+
+    LOG_INFO(logger, "Limits: download " << format_rate(l.rate) << ", per host " << format_rate(l.rate_per_host)
+        << ", disk " << format_rate(l.disk_rate));
+    t.set(l);
+}
+
+void throttle_network(const String &host, int64_t n)
+{
+    auto &t = throttle::instance();
+    auto priority = current_io_priority();
+    if (!host.empty())
+        t.host(host).consume(n, priority);
+    t.network.consume(n, priority);
+}
+
+void throttle_disk(int64_t n)
+{
+    throttle::instance().disk.consume(n, current_io_priority());
+}
+
+int64_t parse_rate(const String &s)
+{
+    size_t pos = 0;
+    double v;
+    try
+    {
+        v = std::stod(s, &pos);
+    }
+    catch (std::exception &)
+    {
+        throw SW_RUNTIME_ERROR("Bad rate: " + s);
+    }
+    auto unit = s.substr(pos);
+    int64_t m = 1;
+    if (unit == "K" || unit == "k")
+        m = 1024;
+    else if (unit == "M" || unit == "m")
+        m = 1024 * 1024;
+    else if (unit == "G" || unit == "g")
+        m = 1024 * 1024 * 1024;
+    else if (!unit.empty())
+        throw SW_RUNTIME_ERROR("Bad rate: " + s);
+    if (!std::isfinite(v) || v < 0)
+        throw SW_RUNTIME_ERROR("Bad rate: " + s);
+    // the conversion of a larger value is undefined
+    if (v >= (double)std::numeric_limits<int64_t>::max() / m)
+        throw SW_RUNTIME_ERROR("Rate is too large: " + s);
+    return int64_t(v * m);
+}
@@ -0,0 +1,110 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+
+//
+// types
+//
+
+// Rate limit shared by threads, in bytes per second, 0 - unlimited.
+// Burst is one second worth of bytes. A consumer may take more than
+// is available and the debt is paid by the next ones, so large blocks
+// are not starved by small ones.
+// While consumers of higher priority wait, lower ones are not served.
+class token_bucket
+{
+public:
+    token_bucket(int64_t rate = 0);
+
+    void set_rate(int64_t rate);
+    int64_t get_rate() const;
+
+    // Blocks until n bytes are allowed.
+    // Returns early when the task of this thread is cancelled.
+    void consume(int64_t n, int priority = 0);
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    mutable std::mutex m;
+    std::condition_variable cv;
+    int64_t rate;
+    double tokens = 0;
+    clock::time_point last;
+    // number of blocked consumers by priority
+    std::map<int, int> waiting;
+
+    void refill(clock::time_point now);
+};
+
+// All values are bytes per second, 0 - unlimited.
+struct throttle_limits
+{
+    // all downloads together
+    int64_t rate = 0;
+    // downloads from one host
+    int64_t rate_per_host = 0;
+    // writes of downloaded and unpacked data
+    int64_t disk_rate = 0;
+};
+
+// Priority of io done on this thread until destroyed.
+class io_priority_scope
+{
+public:
+    io_priority_scope(int priority);
+    ~io_priority_scope();
+
+private:
+    int previous;
+};
+
+//
+// function declarations
+//
+
+throttle_limits get_throttle_limits();
+void set_throttle_limits(const throttle_limits &limits);
+
+// Control file is json with any of "rate", "rate_per_host", "disk_rate".
+// It overrides limits set before this call and is read again when it
+// changes and on SIGHUP. Removing it restores those limits.
+// Changes are picked up within about a second by any throttled transfer
+// and by the download scheduler. Git processes are not throttled.
+void watch_throttle_file(const path &fn);
+// called periodically by the download scheduler and throttled transfers
+void reload_throttle_file();
+
+// block the caller while over the limits
+void throttle_network(const String &host, int64_t n);
+void throttle_disk(int64_t n);
+
+int current_io_priority();
+
+// "512K", "10M", "1G" or bytes; throws on negative, non-finite
+// and too large values
+int64_t parse_rate(const String &s);
@@ -0,0 +1,345 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "functional.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "trace");
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+const int n_phases = (int)trace_phase::count;
+
+struct file_record
+{
+    String name;
+    std::atomic<int64_t> phases[n_phases]{};
+    std::atomic<int64_t> network_bytes{ 0 };
+    std::atomic<int64_t> hashed_bytes{ 0 };
+    std::atomic_int attempts{ 0 };
+};
+
+struct chrome_event
+{
+    const char *name;
+    size_t file;
+    int tid;
+    clock_type::time_point start;
+    clock_type::duration duration;
+};
+
+// sums over all traced files
+struct trace_totals
+{
+    int64_t phases[n_phases]{};
+    int64_t files = 0;
+    int64_t network_bytes = 0;
+    int64_t hashed_bytes = 0;
+};
+
+struct tracer
+{
+    // totals are updated without the lock
+    std::atomic<int64_t> phases[n_phases]{};
+    std::atomic<int64_t> files_traced{ 0 };
+    std::atomic<int64_t> network_bytes{ 0 };
+    std::atomic<int64_t> hashed_bytes{ 0 };
+
+    std::mutex m;
+    // stable addresses, records are referenced by threads
+    std::vector<std::unique_ptr<file_record>> files;
+    std::unordered_map<String, size_t> index;
+    // totals at the last summary
+    trace_totals summarized;
+    std::vector<chrome_event> events;
+    std::atomic_bool records{ false };
+    std::atomic_bool chrome{ false };
+    std::atomic_int next_tid{ 0 };
+    clock_type::time_point origin = clock_type::now();
+
+    static tracer &instance()
+    {
+        static tracer t;
+        return t;
+    }
+
+    file_record *get(const String &name)
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto [i, inserted] = index.emplace(name, files.size());
+        if (inserted)
+        {
+            files.push_back(std::make_unique<file_record>());
+            files.back()->name = name;
+        }
+        auto r = files[i->second].get();
+        r->attempts++;
+        return r;
+    }
+
+    size_t id(const file_record *r)
+    {
+        return index[r->name];
+    }
+
+    trace_totals totals() const
+    {
+        trace_totals t;
+        for (int p = 0; p < n_phases; p++)
+            t.phases[p] = phases[p];
+        t.files = files_traced;
+        t.network_bytes = network_bytes;
+        t.hashed_bytes = hashed_bytes;
+        return t;
+    }
+};
+
+// record of the current file, null when records are not kept
+thread_local file_record *current_file;
+// file_trace scopes open on this thread
+thread_local int file_depth;
+thread_local trace_scope *current_scope;
+thread_local int thread_id = -1;
+
+int this_thread_id()
+{
+    if (thread_id == -1)
+        thread_id = tracer::instance().next_tid++;
+    return thread_id;
+}
+
+void add(file_record *r, trace_phase phase, clock_type::time_point start, clock_type::duration d)
+{
+    if (!file_depth)
+        return;
+    auto &t = tracer::instance();
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    t.phases[(int)phase] += ns;
+    if (!r)
+        return;
+    r->phases[(int)phase] += ns;
+    if (t.chrome)
+    {
+        std::lock_guard<std::mutex> lk(t.m);
+        t.events.push_back({ to_string(phase), t.id(r), this_thread_id(), start, d });
+    }
+}
+
+double seconds(int64_t ns)
+{
+    return ns / 1e9;
+}
+
+double seconds(clock_type::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+}
+
+file_trace::file_trace(const String &name, int attempt)
+    : start(clock_type::now()), attempt(attempt)
+    , record(tracer::instance().records ? tracer::instance().get(name) : nullptr), previous(current_file)
+{
+    current_file = (file_record *)record;
+    file_depth++;
+    if (attempt == 0)
+        tracer::instance().files_traced++;
+}
+
+file_trace::~file_trace()
+{
+    // everything after the first attempt is a retry
+    if (attempt > 0)
+        add(current_file, trace_phase::retry, start, clock_type::now() - start);
+    file_depth--;
+    current_file = (file_record *)previous;
+}
+
+trace_scope::trace_scope(trace_phase phase)
+    : phase(phase), start(clock_type::now()), parent(current_scope)
+{
+    if (phase != trace_phase::retry)
+        current_scope = this;
+}
+
+trace_scope::~trace_scope()
+{
+    auto d = clock_type::now() - start;
+    if (phase == trace_phase::retry)
+    {
+        add(current_file, phase, start, d);
+        return;
+    }
+    current_scope = parent;
+    if (parent)
+        parent->children += d;
+    add(current_file, phase, start, d - children);
+}
+
+const char *to_string(trace_phase p)
+{
+    switch (p)
+    {
+    case trace_phase::stat:
+        return "stat";
+    case trace_phase::catalog:
+        return "catalog";
+    case trace_phase::hash:
+        return "hash";
+    case trace_phase::network:
+        return "network";
+    case trace_phase::unpack:
+        return "unpack";
+    case trace_phase::store:
+        return "store";
+    case trace_phase::retry:
+        return "retry";
+    default:
+        return "";
+    }
+}
+
+void enable_file_records()
+{
+    tracer::instance().records = true;
+}
+
+void enable_chrome_trace()
+{
+    tracer::instance().records = true;
+    tracer::instance().chrome = true;
+}
+
+void trace_add(trace_phase phase, std::chrono::steady_clock::duration d)
+{
+    if (current_scope)
+        current_scope->children += d;
+    add(current_file, phase, clock_type::now() - d, d);
+}
+
+void trace_network_bytes(int64_t n)
+{
+    if (!file_depth)
+        return;
+    tracer::instance().network_bytes += n;
+    if (current_file)
+        current_file->network_bytes += n;
+}
+
+void trace_hashed_bytes(int64_t n)
+{
+    if (!file_depth)
+        return;
+    tracer::instance().hashed_bytes += n;
+    if (current_file)
+        current_file->hashed_bytes += n;
+}
+
+void log_trace_summary()
+{
+    auto &t = tracer::instance();
+    std::lock_guard<std::mutex> lk(t.m);
+    auto now = t.totals();
+    auto &last = t.summarized;
+    if (now.files == last.files)
+        return;
+
+    String s;
+    for (int p = 0; p < n_phases; p++)
+        s += String(" ") + to_string((trace_phase)p) + " " + (boost::format("%.2f") % seconds(now.phases[p] - last.phases[p])).str() + " s,";
+    LOG_INFO(logger, "Time by phase (" << now.files - last.files << " files):" << s
+        << " received " << (now.network_bytes - last.network_bytes) / 1024 / 1024 << " MB, hashed "
+        << (now.hashed_bytes - last.hashed_bytes) / 1024 / 1024 << " MB");
+    last = now;
+}
+
+void write_metrics(const path &fn)
+{
+    auto &t = tracer::instance();
+    std::lock_guard<std::mutex> lk(t.m);
+
+    ptree root, files;
+    for (auto &pf : t.files)
+    {
+        auto &f = *pf;
+        ptree p;
+        p.put("name", f.name);
+        for (int i = 0; i < n_phases; i++)
+            p.put(to_string((trace_phase)i), seconds(f.phases[i].load()));
+        p.put("network_bytes", (int64_t)f.network_bytes);
+        p.put("hashed_bytes", (int64_t)f.hashed_bytes);
+        p.put("attempts", (int)f.attempts);
+        files.push_back({ "", p });
+    }
+
+    auto totals = t.totals();
+    ptree totals_tree;
+    for (int i = 0; i < n_phases; i++)
+        totals_tree.put(to_string((trace_phase)i), seconds(totals.phases[i]));
+    totals_tree.put("network_bytes", totals.network_bytes);
+    totals_tree.put("hashed_bytes", totals.hashed_bytes);
+    totals_tree.put("files", totals.files);
+    totals_tree.put("wall", seconds(clock_type::now() - t.origin));
+    root.add_child("totals", totals_tree);
+    root.add_child("files", files);
+    pt::write_json(fn.string(), root);
+}
+
+void write_chrome_trace(const path &fn)
+{
+    auto &t = tracer::instance();
+    std::lock_guard<std::mutex> lk(t.m);
+
+    // written by hand, the trace can have millions of events
+    std::ofstream o(fn);
+    if (!o)
+        throw SW_RUNTIME_ERROR("Cannot open " + fn.string());
+    o << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (auto &e : t.events)
+    {
+        if (!first)
+            o << ",\n";
+        first = false;
+        ptree args;
+        args.put("file", t.files[e.file]->name);
+        std::ostringstream a;
+        pt::write_json(a, args, false);
+        auto args_json = a.str();
+        while (!args_json.empty() && args_json.back() == '\n')
+            args_json.pop_back();
+        o << "{\"name\":\"" << e.name << "\",\"cat\":\"file\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid
+            << ",\"ts\":" << std::chrono::duration_cast<std::chrono::microseconds>(e.start - t.origin).count()
+            << ",\"dur\":" << std::chrono::duration_cast<std::chrono::microseconds>(e.duration).count()
+            << ",\"args\":" << args_json << "}";
+    }
+    o << "\n]}\n";
+}
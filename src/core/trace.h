@@ -0,0 +1,105 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <chrono>
+#include <stdint.h>
+
+//
+// types
+//
+
+// Where time goes while a file is processed.
+// Phases are exclusive: a nested phase pauses the one around it.
+enum class trace_phase
+{
+    stat,
+    catalog,
+    hash,
+    network,
+    unpack,
+    store,
+    // wall time of repeated attempts, overlaps the phases above
+    retry,
+
+    count,
+};
+
+// Attributes work done on this thread to one file until destroyed.
+// Per-file records are kept only when enabled, records of the same
+// name (repeated attempts) are merged. Totals by phase are always kept.
+// attempt - 0 for the first one, the time of others is a retry.
+class file_trace
+{
+public:
+    file_trace(const String &name, int attempt = 0);
+    ~file_trace();
+
+private:
+    std::chrono::steady_clock::time_point start;
+    int attempt;
+    void *record;
+    void *previous;
+};
+
+// Measures one phase of the current file.
+// A retry scope only measures wall time and does not pause other phases.
+class trace_scope
+{
+public:
+    trace_scope(trace_phase phase);
+    ~trace_scope();
+
+private:
+    trace_phase phase;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration children{};
+    trace_scope *parent;
+
+    friend void trace_add(trace_phase phase, std::chrono::steady_clock::duration d);
+};
+
+//
+// function declarations
+//
+
+const char *to_string(trace_phase p);
+
+// Per-file records for write_metrics(), a 300k files sync has
+// 300k of them.
+void enable_file_records();
+// Chrome trace events, per-file records are enabled with them.
+void enable_chrome_trace();
+
+// work done for the current file on another thread,
+// it is not counted in the enclosing phase
+void trace_add(trace_phase phase, std::chrono::steady_clock::duration d);
+void trace_network_bytes(int64_t n);
+void trace_hashed_bytes(int64_t n);
+
+// Logs totals by phase of the files traced since the last call.
+void log_trace_summary();
+
+// {"totals": {...}, "files": [{"name", "<phase>" seconds..., "network_bytes", "hashed_bytes", "attempts"}]}
+// files are there when records are enabled
+void write_metrics(const path &fn);
+// Chrome trace-event format, open in chrome://tracing or Perfetto
+void write_chrome_trace(const path &fn);
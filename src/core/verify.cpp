@@ -0,0 +1,233 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "verify.h"
+
+#include "digest.h"
+#include "lwt.h"
+#include "store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "verify");
+
+static std::atomic<int64_t> n_problems{ 0 };
+
+enum class file_state
+{
+    ok,
+    missing,
+    corrupt,
+    modified,
+    outdated,
+};
+
+static path tracked_path(const repository &data, const repository::file &f, const path &dir, const path &output_dir)
+{
+    if (f.packed)
+        return dir / (data.file_prefix + String(data.str(f.name)));
+    String check_path(data.str(f.check_path));
+    if (!check_path.empty() && check_path[0] == '/')
+        check_path = check_path.substr(1);
+    return output_dir / check_path;
+}
+
+static file_state check_file(const repository &data, const repository::file &f, const path &file,
+    const path &output_dir, local_lwt &lwt, verify_report &report, std::mutex &m)
+{
+    auto expected = data.digest(f);
+
+    if (f.packed)
+    {
+        // the archive is not kept, only its extraction can be checked
+        String check_path(data.str(f.check_path));
+        if (!check_path.empty() && check_path[0] == '/')
+            check_path = check_path.substr(1);
+        auto e = lwt.find(file);
+        if (!e || (e->hash != expected && !(f.has_md5 && e->hash == data.md5(f))))
+            return file_state::missing;
+        if (!check_path.empty() && !fs::exists(output_dir / check_path))
+            return file_state::missing;
+        return file_state::ok;
+    }
+
+    std::error_code ec;
+    if (!fs::is_regular_file(file, ec))
+        return file_state::missing;
+    // nothing to compare with, only presence can be checked
+    if (expected.empty())
+        return file_state::ok;
+
+    auto file_lwt = fs::last_write_time(file).time_since_epoch().count();
+    auto size = fs::file_size(file);
+    auto hash = hash_file(file, digest_algorithm(expected));
+    {
+        std::lock_guard<std::mutex> lk(m);
+        report.files++;
+        report.bytes += size;
+    }
+
+    auto e = lwt.find(file);
+    if (hash == expected)
+    {
+        if (!e || e->lwt != file_lwt || e->hash != hash)
+        {
+            local_lwt::file nf;
+            nf.lwt = file_lwt;
+            nf.hash = hash;
+            lwt.set(file, nf);
+        }
+        return file_state::ok;
+    }
+    if (!e || e->lwt != file_lwt)
+        return file_state::modified;
+    if (e->hash == hash)
+        return file_state::outdated;
+    return file_state::corrupt;
+}
+
+repository verify_files(const path &dir, const path &output_dir, const repository &data, bool repair, verify_report &report)
+{
+    LOG_INFO(logger, "Verifying " << data.files.size() << " file(s) in " << output_dir);
+
+    local_lwt lwt;
+    lwt.open(path(BOOTSTRAP_DOWNLOADS) / LAST_WRITE_TIME_JOURNAL);
+
+    // largest first, so the tail of the run is short
+    std::vector<size_t> order(data.files.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&data](auto a, auto b)
+    {
+        return data.files[a].size > data.files[b].size;
+    });
+
+    std::vector<file_state> states(data.files.size(), file_state::ok);
+    std::atomic_size_t next{ 0 };
+    std::mutex m;
+    auto start = std::chrono::steady_clock::now();
+
+    size_t n_threads = settings.jobs ? settings.jobs : std::thread::hardware_concurrency();
+    n_threads = std::clamp<size_t>(n_threads, 1, std::max<size_t>(data.files.size(), 1));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < n_threads; t++)
+    {
+        threads.emplace_back([&]()
+        {
+            size_t i;
+            while ((i = next++) < order.size())
+            {
+                auto &f = data.files[order[i]];
+                auto file = tracked_path(data, f, dir, output_dir);
+                try
+                {
+                    states[order[i]] = check_file(data, f, file, output_dir, lwt, report, m);
+                }
+                catch (std::exception &e)
+                {
+                    LOG_ERROR(logger, "Cannot check " << file << ": " << e.what());
+                    states[order[i]] = file_state::corrupt;
+                }
+            }
+        });
+    }
+    for (auto &t : threads)
+        t.join();
+
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    repository bad = data;
+    bad.files.clear();
+    for (size_t i = 0; i < data.files.size(); i++)
+    {
+        auto &f = data.files[i];
+        auto file = tracked_path(data, f, dir, output_dir);
+        switch (states[i])
+        {
+        case file_state::ok:
+            continue;
+        case file_state::missing:
+            LOG_WARN(logger, "missing: " << file);
+            report.missing.push_back(file);
+            break;
+        case file_state::corrupt:
+            LOG_WARN(logger, "corrupt: " << file);
+            report.corrupt.push_back(file);
+            break;
+        case file_state::modified:
+            report.modified.push_back(file);
+            if (!settings.repair_modified)
+            {
+                // user's changes stay unless asked otherwise
+                LOG_WARN(logger, "modified: " << file << (repair ? ", kept (--repair-modified replaces it)" : ""));
+                continue;
+            }
+            LOG_WARN(logger, "modified: " << file);
+            break;
+        case file_state::outdated:
+            LOG_INFO(logger, "outdated: " << file);
+            report.outdated.push_back(file);
+            break;
+        }
+        bad.files.push_back(f);
+
+        if (!repair)
+            continue;
+
+        // make the normal download path fetch it again
+        std::error_code ec;
+        lwt.erase(file);
+        if (f.packed)
+            continue;
+        fs::remove(file, ec);
+        auto expected = data.digest(f);
+        // entries without a digest are not kept in the store
+        if (expected.empty())
+            continue;
+        auto blob = store_blob_path(dir, expected);
+        if (fs::exists(blob, ec))
+        {
+            // a hard linked copy shares its contents with the blob
+            if (hash_file(blob, digest_algorithm(expected)) != expected)
+            {
+                LOG_WARN(logger, "Removing damaged store blob " << blob);
+                fs::remove(blob, ec);
+            }
+            lwt.erase(blob);
+        }
+    }
+
+    n_problems += report.problems();
+
+    LOG_INFO(logger, "Verified " << report.files << " file(s), " << report.bytes / 1024 / 1024 << " MB in "
+        << (int64_t)seconds << " s (" << (int64_t)(seconds > 0 ? report.bytes / seconds / 1024 / 1024 : 0) << " MB/s)");
+    LOG_INFO(logger, "missing: " << report.missing.size() << ", corrupt: " << report.corrupt.size()
+        << ", modified: " << report.modified.size() << ", outdated: " << report.outdated.size());
+
+    return bad;
+}
+
+int64_t integrity_problems()
+{
+    return n_problems;
+}
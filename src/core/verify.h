@@ -0,0 +1,57 @@
+/*
+ * Polygon-4 Bootstrapper
+ * Copyright (C) 2015 lzwdgc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "manifest.h"
+
+#include <stdint.h>
+
+//
+// types
+//
+
+struct verify_report
+{
+    // not present on disk
+    std::vector<path> missing;
+    // unchanged since we put it there, yet the contents differ
+    std::vector<path> corrupt;
+    // changed by the user
+    std::vector<path> modified;
+    // untouched older version of the file
+    std::vector<path> outdated;
+    int64_t files = 0;
+    int64_t bytes = 0;
+
+    int64_t problems() const { return missing.size() + corrupt.size() + modified.size(); }
+};
+
+//
+// function declarations
+//
+
+// Hashes every tracked file of data in parallel, whatever the lwt catalog
+// says, and logs what is wrong. Catalog entries of good files are refreshed.
+// With repair, bad files are removed together with damaged store blobs and
+// catalog entries, and the returned list holds the entries to fetch again.
+// Files modified by the user are left alone unless settings.repair_modified.
+repository verify_files(const path &dir, const path &output_dir, const repository &data, bool repair, verify_report &report);
+
+// problems found by all verify_files() calls of the process
+int64_t integrity_problems();
@@ -28,6 +28,11 @@ void build(Solution &s)
     core.Public += "pub.egorpugin.primitives.command"_dep;
     core.Public += "pub.egorpugin.primitives.executor"_dep;
     core.Public += "pub.egorpugin.primitives.sw.main"_dep;
+    core.Public += "org.sw.demo.badger.curl.libcurl"_dep;
+    core.Public += "org.sw.demo.openssl.crypto"_dep;
+    core.Public += "org.sw.demo.libarchive.libarchive"_dep;
+    core.Public += "org.sw.demo.BLAKE3team.BLAKE3"_dep;
+    core.Public += "org.sw.demo.Cyan4973.xxHash"_dep;
 
     {
         auto &t = p.addTarget<Executable>("developer");
@@ -63,5 +68,13 @@ void build(Solution &s)
         t += "src/remove_untracked_content.cpp";
         t += core;
     }
+
+    {
+        auto &t = p.addTarget<Executable>("bench_download");
+        t += cppstd;
+        t += "src/bench_download.cpp";
+        t += core;
+        t += "org.sw.demo.boost.asio"_dep;
+    }
 }
 